@@ -0,0 +1,399 @@
+#include "include/sfmm.h"
+
+/**
+ * Offline analyzer for the files sf_heap_dump writes.
+ *
+ * ./analyze <dump>			summary, size histogram and fragmentation map
+ * ./analyze <before> <after>	what grew between two dumps of the same program
+ *
+ * Only the header is included, not the allocator, so everything here runs on
+ * the C library's malloc.
+ */
+
+/* Address ranges in the fragmentation map */
+#define MAP_ROWS 32
+
+/* Requested sizes the diff lists, biggest change first */
+#define DIFF_ROWS 20
+
+struct dump
+{
+	struct sf_dump_header header;
+	struct sf_dump_record *records;
+	size_t count;
+};
+
+/* Allocated regions of one requested size */
+struct size_total
+{
+	int64_t requested;
+	int64_t count;
+	int64_t bytes;
+};
+
+struct size_change
+{
+	int64_t requested;
+	int64_t count;	// after - before
+	int64_t bytes;
+};
+
+static int read_dump(const char *path, struct dump *dump);
+static void print_summary(const struct dump *dump);
+static void print_histogram(const struct dump *dump);
+static void print_fragmentation_map(const struct dump *dump);
+static void print_diff(const struct dump *before, const struct dump *after);
+static size_t totals_by_size(const struct dump *dump, struct size_total **out);
+static int size_class(int64_t size);
+static int compare_requested(const void *a, const void *b);
+static int compare_growth(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2 && argc != 3)
+	{
+		fprintf(stderr, "usage: %s <dump> [<later dump>]\n", argv[0]);
+		return 1;
+	}
+
+	struct dump before;
+	if (read_dump(argv[1], &before) != 0)
+		return 1;
+
+	if (argc == 2)
+	{
+		print_summary(&before);
+		print_histogram(&before);
+		print_fragmentation_map(&before);
+		return 0;
+	}
+
+	struct dump after;
+	if (read_dump(argv[2], &after) != 0)
+		return 1;
+
+	print_diff(&before, &after);
+	return 0;
+}
+
+/**
+ * Load a whole dump and check it is one we understand.
+ * @return 0, or -1 after printing why not.
+ */
+static int read_dump(const char *path, struct dump *dump)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	if (fread(&dump->header, sizeof(dump->header), 1, file) != 1
+		|| dump->header.magic != SF_DUMP_MAGIC)
+	{
+		fprintf(stderr, "%s: not a heap dump\n", path);
+		fclose(file);
+		return -1;
+	}
+
+	if (dump->header.version != SF_DUMP_VERSION)
+	{
+		fprintf(stderr, "%s: dump version %d, expected %d\n", path, dump->header.version, SF_DUMP_VERSION);
+		fclose(file);
+		return -1;
+	}
+
+	size_t capacity = 1024;
+	dump->records = malloc(capacity * sizeof(struct sf_dump_record));
+	dump->count = 0;
+
+	size_t n;
+	while (dump->records != NULL
+		&& (n = fread(dump->records + dump->count, sizeof(struct sf_dump_record), capacity - dump->count, file)) > 0)
+	{
+		dump->count += n;
+		if (dump->count == capacity)
+		{
+			capacity *= 2;
+			dump->records = realloc(dump->records, capacity * sizeof(struct sf_dump_record));
+		}
+	}
+
+	if (dump->records == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", path);
+		fclose(file);
+		return -1;
+	}
+
+	if (ferror(file))
+	{
+		perror(path);
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+static void print_summary(const struct dump *dump)
+{
+	int64_t allocated = 0, allocated_bytes = 0, requested_bytes = 0;
+	int64_t free_regions = 0, free_bytes = 0, largest_free = 0;
+
+	for (size_t i = 0; i < dump->count; i++)
+	{
+		const int64 *hp = &dump->records[i].header;
+		if (GET_ALLOC(hp))
+		{
+			allocated++;
+			allocated_bytes += GET_REGION_SIZE(hp);
+			requested_bytes += GET_REQUESTED_SIZE(hp);
+		}
+		else
+		{
+			free_regions++;
+			free_bytes += GET_REGION_SIZE(hp);
+			if (GET_REGION_SIZE(hp) > largest_free)
+				largest_free = GET_REGION_SIZE(hp);
+		}
+	}
+
+	printf("heap at %#llx, %lld bytes, %lld bytes in large objects\n",
+		(unsigned long long)dump->header.heap_start, (long long)dump->header.heap_size, (long long)dump->header.large_bytes);
+	printf("%lld allocated regions, %lld bytes (%lld requested)\n",
+		(long long)allocated, (long long)allocated_bytes, (long long)requested_bytes);
+	printf("%lld free regions, %lld bytes, largest %lld\n",
+		(long long)free_regions, (long long)free_bytes, (long long)largest_free);
+	if (free_bytes > 0)
+		printf("fragmentation %.1f%%\n", 100.0 * (1.0 - (double)largest_free / free_bytes));
+	printf("\n");
+}
+
+/**
+ * Power of two size classes: class k holds regions of [2^k, 2^(k+1)) bytes.
+ */
+static void print_histogram(const struct dump *dump)
+{
+	int64_t allocated[64] = {0}, allocated_bytes[64] = {0};
+	int64_t free_regions[64] = {0}, free_bytes[64] = {0};
+	int lowest = 63, highest = 0;
+
+	for (size_t i = 0; i < dump->count; i++)
+	{
+		const int64 *hp = &dump->records[i].header;
+		int64_t size = GET_REGION_SIZE(hp);
+		int k = size_class(size);
+		if (GET_ALLOC(hp))
+		{
+			allocated[k]++;
+			allocated_bytes[k] += size;
+		}
+		else
+		{
+			free_regions[k]++;
+			free_bytes[k] += size;
+		}
+
+		if (k < lowest)
+			lowest = k;
+		if (k > highest)
+			highest = k;
+	}
+
+	printf("%-21s %10s %12s %10s %12s\n", "region size", "allocated", "bytes", "free", "bytes");
+	for (int k = lowest; k <= highest && dump->count > 0; k++)
+	{
+		printf("%9lld - %-9lld %10lld %12lld %10lld %12lld\n",
+			1LL << k, (1LL << (k + 1)) - 1,
+			(long long)allocated[k], (long long)allocated_bytes[k], (long long)free_regions[k], (long long)free_bytes[k]);
+	}
+	printf("\n");
+}
+
+/**
+ * Split the heap into MAP_ROWS equal address ranges and show how full each
+ * one is. A region is counted in the range its header is in.
+ */
+static void print_fragmentation_map(const struct dump *dump)
+{
+	int64_t span = dump->header.heap_size;
+	if (span == 0 || dump->count == 0)
+		return;
+
+	int64_t row_size = ALIGN_UP((span + MAP_ROWS - 1) / MAP_ROWS, DSIZE);
+	int64_t used[MAP_ROWS] = {0}, free_bytes[MAP_ROWS] = {0}, free_regions[MAP_ROWS] = {0}, largest_free[MAP_ROWS] = {0};
+
+	for (size_t i = 0; i < dump->count; i++)
+	{
+		const int64 *hp = &dump->records[i].header;
+		int row = dump->records[i].offset / row_size;
+		if (row >= MAP_ROWS)
+			row = MAP_ROWS - 1;
+
+		int64_t size = GET_REGION_SIZE(hp);
+		if (GET_ALLOC(hp))
+			used[row] += size;
+		else
+		{
+			free_bytes[row] += size;
+			free_regions[row]++;
+			if (size > largest_free[row])
+				largest_free[row] = size;
+		}
+	}
+
+	printf("%-23s %6s %12s %8s %12s\n", "offset", "used", "free bytes", "free", "largest");
+	for (int row = 0; row < MAP_ROWS; row++)
+	{
+		int64_t total = used[row] + free_bytes[row];
+		if (total == 0)
+			continue;
+
+		printf("%#10llx - %#10llx %5.1f%% %12lld %8lld %12lld\n",
+			(unsigned long long)(row * row_size), (unsigned long long)((row + 1) * row_size - 1),
+			100.0 * used[row] / total, (long long)free_bytes[row], (long long)free_regions[row], (long long)largest_free[row]);
+	}
+	printf("\n");
+}
+
+/**
+ * Compare the allocated regions of two dumps by requested size. Sizes whose
+ * live bytes keep growing from one dump to the next are the leak and bloat
+ * suspects.
+ */
+static void print_diff(const struct dump *before, const struct dump *after)
+{
+	struct size_total *old_totals, *new_totals;
+	size_t old_count = totals_by_size(before, &old_totals);
+	size_t new_count = totals_by_size(after, &new_totals);
+
+	struct size_change *changes = malloc((old_count + new_count) * sizeof(struct size_change) + 1);
+	if (changes == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+
+	// Both lists are sorted by requested size, so merge them.
+	size_t i = 0, j = 0, n = 0;
+	int64_t total_count = 0, total_bytes = 0;
+	while (i < old_count || j < new_count)
+	{
+		struct size_change change = {0};
+		if (j == new_count || (i < old_count && old_totals[i].requested < new_totals[j].requested))
+		{
+			change.requested = old_totals[i].requested;
+			change.count = -old_totals[i].count;
+			change.bytes = -old_totals[i].bytes;
+			i++;
+		}
+		else if (i == old_count || new_totals[j].requested < old_totals[i].requested)
+		{
+			change.requested = new_totals[j].requested;
+			change.count = new_totals[j].count;
+			change.bytes = new_totals[j].bytes;
+			j++;
+		}
+		else
+		{
+			change.requested = new_totals[j].requested;
+			change.count = new_totals[j].count - old_totals[i].count;
+			change.bytes = new_totals[j].bytes - old_totals[i].bytes;
+			i++;
+			j++;
+		}
+
+		total_count += change.count;
+		total_bytes += change.bytes;
+		if (change.count != 0 || change.bytes != 0)
+			changes[n++] = change;
+	}
+
+	qsort(changes, n, sizeof(struct size_change), compare_growth);
+
+	printf("heap size %+lld bytes, large objects %+lld bytes\n",
+		(long long)(after->header.heap_size - before->header.heap_size),
+		(long long)(after->header.large_bytes - before->header.large_bytes));
+	printf("allocated regions %+lld, %+lld bytes\n\n", (long long)total_count, (long long)total_bytes);
+
+	printf("%12s %10s %14s\n", "requested", "regions", "bytes");
+	for (size_t k = 0; k < n && k < DIFF_ROWS; k++)
+		printf("%12lld %+10lld %+14lld\n", (long long)changes[k].requested, (long long)changes[k].count, (long long)changes[k].bytes);
+	if (n > DIFF_ROWS)
+		printf("(%zu more sizes changed)\n", n - DIFF_ROWS);
+
+	free(changes);
+	free(old_totals);
+	free(new_totals);
+}
+
+/**
+ * Count the allocated regions of each requested size.
+ * @param out Set to the totals, sorted by requested size. The caller frees it.
+ * @return The number of distinct sizes.
+ */
+static size_t totals_by_size(const struct dump *dump, struct size_total **out)
+{
+	int64_t *sizes = malloc(dump->count * sizeof(int64_t) + 1);
+	struct size_total *totals = malloc(dump->count * sizeof(struct size_total) + 1);
+	if (sizes == NULL || totals == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < dump->count; i++)
+	{
+		if (GET_ALLOC(&dump->records[i].header))
+			sizes[n++] = GET_REQUESTED_SIZE(&dump->records[i].header);
+	}
+	qsort(sizes, n, sizeof(int64_t), compare_requested);
+
+	size_t distinct = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (distinct == 0 || totals[distinct - 1].requested != sizes[i])
+		{
+			totals[distinct].requested = sizes[i];
+			totals[distinct].count = 0;
+			totals[distinct].bytes = 0;
+			distinct++;
+		}
+		totals[distinct - 1].count++;
+		totals[distinct - 1].bytes += sizes[i];
+	}
+
+	free(sizes);
+	*out = totals;
+	return distinct;
+}
+
+/**
+ * @return floor(log2(size)).
+ */
+static int size_class(int64_t size)
+{
+	return size <= 1 ? 0 : 63 - __builtin_clzll(size);
+}
+
+static int compare_requested(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Biggest change in bytes first, growth before shrinkage of the same amount.
+ */
+static int compare_growth(const void *a, const void *b)
+{
+	int64_t x = ((const struct size_change *)a)->bytes, y = ((const struct size_change *)b)->bytes;
+	int64_t abs_x = x < 0 ? -x : x, abs_y = y < 0 ? -y : y;
+	if (abs_x != abs_y)
+		return (abs_x < abs_y) - (abs_x > abs_y);
+	return (x < y) - (x > y);
+}
@@ -0,0 +1,925 @@
+#include "sfmm.c"
+
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+/**
+ * Benchmarks for the allocator. Build with the same flags as the driver
+ * (make bench, make benchhuge, ...) to compare policies.
+ *
+ * ./bench           runs every benchmark
+ * ./bench <name>    runs only the named benchmark
+ */
+
+struct benchmark
+{
+	const char *name;
+	void (*run)(void);
+};
+
+/**
+ * Seconds since some fixed point, for timing.
+ */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Open a counter for data TLB load misses of this process.
+ * @return the counter fd, or -1 if the kernel does not let us count them.
+ */
+static int open_dtlb_counter()
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB
+				| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Fill a large heap with mixed size regions, then touch them in random order.
+ * Reports dTLB misses so -DHUGEPAGE can be compared against the default.
+ */
+static void bench_tlb()
+{
+	#define TLB_REGIONS 65536
+	#define TLB_TOUCHES 20000000
+
+	static char *regions[TLB_REGIONS];
+	size_t total = 0;
+
+	srand(1);
+	int i;
+	for (i = 0; i < TLB_REGIONS; i++)
+	{
+		size_t size = 64 + rand() % 4096;
+		regions[i] = sf_malloc(size);
+		memset(regions[i], 1, size);
+		total += size;
+	}
+
+	int fd = open_dtlb_counter();
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	double start = now();
+	int64 sum = 0;
+	unsigned int r = 12345;
+	for (i = 0; i < TLB_TOUCHES; i++)
+	{
+		r = r * 1103515245 + 12345;
+		sum += regions[(r >> 8) % TLB_REGIONS][0];
+	}
+	double elapsed = now() - start;
+
+	int64 misses = 0;
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = 0;
+		close(fd);
+	}
+
+	#ifdef HUGEPAGE
+		const char *mode = "huge";
+	#else
+		const char *mode = "4k";
+	#endif
+
+	printf("tlb: mode=%s heap=%lu bytes=%lu touches=%d time=%.3fs (sum %lu)\n",
+		mode, heap->heap_size, total, TLB_TOUCHES, elapsed, sum);
+	if (fd >= 0)
+		printf("tlb: dTLB load misses=%lu (%.4f per touch)\n", misses, (double)misses / TLB_TOUCHES);
+	else
+		printf("tlb: dTLB load misses=n/a (perf_event_open not permitted)\n");
+
+	for (i = 0; i < TLB_REGIONS; i++)
+		sf_free(regions[i]);
+}
+
+/**
+ * Average time of one sf_realloc that grows a buffer of the given size by a page.
+ */
+static double time_realloc_growth(size_t size)
+{
+	#define REALLOC_ROUNDS 64
+
+	char *buf = sf_malloc(size);
+	memset(buf, 1, size);
+
+	double start = now();
+	int i;
+	for (i = 0; i < REALLOC_ROUNDS; i++)
+	{
+		buf = sf_realloc(buf, size + (i + 1) * FOUR_KB);
+		buf[size] = 2;
+	}
+	double elapsed = now() - start;
+
+	sf_free(buf);
+	return elapsed / REALLOC_ROUNDS;
+}
+
+/**
+ * Growing realloc of buffers from 256 KB to 256 MB, through mremap (large objects)
+ * and through the heap (copying). The mremap column should stay flat.
+ */
+static void bench_realloc()
+{
+	size_t size;
+	for (size = 256 * 1024; size <= 256 * 1024 * 1024; size *= 4)
+	{
+		sf_mallopt(SF_LARGE_THRESHOLD, LARGE_THRESHOLD);
+		double remap = time_realloc_growth(size);
+
+		sf_mallopt(SF_LARGE_THRESHOLD, (size_t)-1);
+		double copy = time_realloc_growth(size);
+
+		printf("realloc: size=%9lu mremap=%10.2fus copy=%10.2fus\n", size, remap * 1e6, copy * 1e6);
+	}
+
+	sf_mallopt(SF_LARGE_THRESHOLD, LARGE_THRESHOLD);
+}
+
+/**
+ * Time to allocate and first-touch 64 MB in 2 KB pieces.
+ */
+static double time_first_touch()
+{
+	#define TOUCH_PIECES 32768
+	#define TOUCH_PIECE_SIZE 2000
+
+	static char *pieces[TOUCH_PIECES];
+
+	double start = now();
+	int i;
+	for (i = 0; i < TOUCH_PIECES; i++)
+	{
+		pieces[i] = sf_malloc(TOUCH_PIECE_SIZE);
+		memset(pieces[i], 1, TOUCH_PIECE_SIZE);
+	}
+	double elapsed = now() - start;
+
+	for (i = TOUCH_PIECES - 1; i >= 0; i--)
+		sf_free(pieces[i]);
+
+	return elapsed;
+}
+
+/**
+ * Startup cost of a 64 MB working set without a reservation, and after
+ * sf_reserve with and without prefaulting. Each case runs in its own child
+ * so it starts from a heap with nothing faulted in.
+ */
+static void bench_reserve()
+{
+	static const struct
+	{
+		const char *name;
+		int reserve;
+		int flags;
+	} cases[] =
+	{
+		{ "cold heap", 0, 0 },
+		{ "sf_reserve", 1, 0 },
+		{ "prefault", 1, SF_RESERVE_PREFAULT },
+		{ "parallel prefault", 1, SF_RESERVE_PREFAULT | SF_RESERVE_PARALLEL },
+	};
+
+	size_t bytes = (size_t)TOUCH_PIECES * REGION_SIZE(TOUCH_PIECE_SIZE);
+	size_t i;
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			long ns = cases[i].reserve ? sf_reserve(bytes, cases[i].flags) : 0;
+			printf("reserve: %-18s took=%8.2fms touch=%8.2fms\n", cases[i].name, ns / 1e6, time_first_touch() * 1e3);
+			exit(EXIT_SUCCESS);
+		}
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/* What the memory handed to the timed allocations was used for before */
+enum history { FRESH, REGROWN, REUSED };
+
+/**
+ * Average time of count allocations of size bytes, with sf_calloc or sf_malloc.
+ * Unless the memory is fresh, everything is allocated, written and freed
+ * first. Freed memory at the top of the heap is trimmed, and comes back zero
+ * when the heap grows again. For reuse a live block above it keeps it in
+ * the heap, no longer known to be zero.
+ */
+static double time_allocations(size_t size, int count, bool calloc, enum history history)
+{
+	static void *blocks[4096];
+	void *pin = NULL;
+	int i;
+
+	if (history != FRESH)
+	{
+		for (i = 0; i < count; i++)
+		{
+			blocks[i] = sf_malloc(size);
+			memset(blocks[i], 1, size);
+		}
+		if (history == REUSED)
+			pin = sf_malloc(1);
+		for (i = 0; i < count; i++)
+			sf_free(blocks[i]);
+	}
+
+	double start = now();
+	for (i = 0; i < count; i++)
+		blocks[i] = calloc ? sf_calloc(1, size) : sf_malloc(size);
+	double elapsed = now() - start;
+
+	for (i = 0; i < count; i++)
+		sf_free(blocks[i]);
+	if (pin != NULL)
+		sf_free(pin);
+	return elapsed / count;
+}
+
+/**
+ * sf_calloc against sf_malloc, on fresh heap memory and on memory trimmed
+ * and grown again (both known zero), and on reused memory (zeroed with
+ * vector stores).
+ */
+static void bench_calloc()
+{
+	size_t sizes[] = { 256, 4096, 65536, 120000 };
+	size_t i;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		int count = 4096 * 256 / sizes[i] + 64;
+		if (count > 4096)
+			count = 4096;
+
+		// Fresh memory in each child, so the first measurement sees a new heap.
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			double fresh_calloc = time_allocations(sizes[i], count, true, FRESH);
+			double malloc_time = time_allocations(sizes[i], count, false, REUSED);
+			double regrown_calloc = time_allocations(sizes[i], count, true, REGROWN);
+			double reused_calloc = time_allocations(sizes[i], count, true, REUSED);
+			printf("calloc: size=%6lu malloc=%8.1fns calloc fresh=%8.1fns calloc regrown=%8.1fns calloc reused=%8.1fns\n",
+				sizes[i], malloc_time * 1e9, fresh_calloc * 1e9, regrown_calloc * 1e9, reused_calloc * 1e9);
+			exit(EXIT_SUCCESS);
+		}
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/**
+ * Average time to allocate and free a struct with three arrays, one object at
+ * a time and with sf_comalloc/sf_free_batch.
+ */
+static void bench_comalloc()
+{
+	#define GROUPS 4096
+	#define GROUP_SIZE 4
+
+	static void *groups[GROUPS][GROUP_SIZE];
+	const size_t sizes[GROUP_SIZE] = { 48, 256, 256, 1024 };
+	int round;
+	for (round = 0; round < 2; round++)
+	{
+		double start = now();
+		int i, j;
+		for (i = 0; i < GROUPS; i++)
+		{
+			if (round == 0)
+				for (j = 0; j < GROUP_SIZE; j++)
+					groups[i][j] = sf_malloc(sizes[j]);
+			else
+				sf_comalloc(GROUP_SIZE, sizes, groups[i]);
+		}
+		for (i = 0; i < GROUPS; i++)
+		{
+			if (round == 0)
+				for (j = 0; j < GROUP_SIZE; j++)
+					sf_free(groups[i][j]);
+			else
+				sf_free_batch(groups[i], GROUP_SIZE);
+		}
+		double elapsed = now() - start;
+
+		printf("comalloc: %-8s %8.1fns per group\n", round == 0 ? "separate" : "grouped", elapsed / GROUPS * 1e9);
+	}
+}
+
+/**
+ * Average time of sf_free against sf_free_sized with a few thousand live
+ * regions, freed in random order.
+ */
+static void bench_free_sized()
+{
+	#define LIVE_REGIONS 8192
+
+	static void *live[LIVE_REGIONS];
+	static size_t sizes[LIVE_REGIONS];
+	int round;
+	for (round = 0; round < 2; round++)
+	{
+		srand(1);
+		int i;
+		for (i = 0; i < LIVE_REGIONS; i++)
+		{
+			sizes[i] = 16 + rand() % 512;
+			live[i] = sf_malloc(sizes[i]);
+		}
+
+		double start = now();
+		unsigned int r = 12345;
+		for (i = 0; i < LIVE_REGIONS; i++)
+		{
+			r = r * 1103515245 + 12345;
+			int j = (r >> 8) % LIVE_REGIONS;
+			while (live[j] == NULL)
+				j = (j + 1) % LIVE_REGIONS;
+
+			if (round == 0)
+				sf_free(live[j]);
+			else
+				sf_free_sized(live[j], sizes[j]);
+			live[j] = NULL;
+		}
+		double elapsed = now() - start;
+
+		printf("free_sized: %-14s %10.1fns per free\n", round == 0 ? "sf_free" : "sf_free_sized", elapsed / LIVE_REGIONS * 1e9);
+	}
+}
+
+/**
+ * Append-heavy code: grow a buffer 16 bytes at a time up to 4 MB, with other
+ * allocations in between so it cannot just extend at the top of the heap.
+ * With the growth predictor the number of moves is logarithmic in the size.
+ */
+static void bench_append()
+{
+	#define APPEND_LIMIT (4 * 1024 * 1024)
+	#define APPEND_STEP 16
+
+	char *buf = NULL;
+	void *spacers[64];
+	int num_spacers = 0;
+	int moves = 0;
+	int reallocs = 0;
+
+	double start = now();
+	size_t size;
+	for (size = APPEND_STEP; size <= APPEND_LIMIT; size += APPEND_STEP)
+	{
+		char *grown = sf_realloc(buf, size);
+		if (grown != buf)
+			moves++;
+		buf = grown;
+		buf[size - 1] = 1;
+		reallocs++;
+
+		if (size % 65536 == 0 && num_spacers < 64)
+			spacers[num_spacers++] = sf_malloc(64);
+	}
+	double elapsed = now() - start;
+
+	printf("append: reallocs=%d moves=%d time=%.3fms (%.1fns per realloc) usable=%lu\n",
+		reallocs, moves, elapsed * 1e3, elapsed / reallocs * 1e9, sf_malloc_usable_size(buf));
+
+	sf_free(buf);
+	while (num_spacers > 0)
+		sf_free(spacers[--num_spacers]);
+}
+
+/**
+ * A request handler's worth of small short-lived objects, freed one by one
+ * with sf_free and all at once with an arena reset.
+ */
+static void bench_arena()
+{
+	#define REQUEST_OBJECTS 4096
+	#define REQUESTS 32
+
+	static void *objects[REQUEST_OBJECTS];
+	struct sf_arena *arena = sf_arena_create(64 * 1024);
+	int round;
+	for (round = 0; round < 2; round++)
+	{
+		srand(1);
+		double start = now();
+		int request, i;
+		for (request = 0; request < REQUESTS; request++)
+		{
+			for (i = 0; i < REQUEST_OBJECTS; i++)
+			{
+				size_t size = 16 + rand() % 256;
+				objects[i] = round == 0 ? sf_malloc(size) : sf_arena_alloc(arena, size);
+				memset(objects[i], 1, size);
+			}
+
+			if (round == 0)
+				for (i = 0; i < REQUEST_OBJECTS; i++)
+					sf_free(objects[i]);
+			else
+				sf_arena_reset(arena);
+		}
+		double elapsed = now() - start;
+
+		printf("arena: %-9s %8.2fms per request\n", round == 0 ? "sf_free" : "arena", elapsed / REQUESTS * 1e3);
+	}
+	sf_arena_destroy(arena);
+}
+
+/**
+ * Tear down a subsystem's worth of allocations by freeing each one, and by
+ * destroying the heap they live in.
+ */
+static void bench_heap_destroy()
+{
+	#define SUBSYSTEM_OBJECTS 20000
+
+	static void *objects[SUBSYSTEM_OBJECTS];
+	int round;
+	for (round = 0; round < 2; round++)
+	{
+		struct sf_heap *h = sf_heap_create(0);
+		srand(1);
+		int i;
+		for (i = 0; i < SUBSYSTEM_OBJECTS; i++)
+			objects[i] = sf_heap_malloc(h, 16 + rand() % 512);
+
+		double start = now();
+		if (round == 0)
+			for (i = SUBSYSTEM_OBJECTS - 1; i >= 0; i--)
+				sf_heap_free(h, objects[i]);
+		sf_heap_destroy(h);
+		double elapsed = now() - start;
+
+		printf("heap_destroy: %-8s %10.3fms\n", round == 0 ? "free all" : "destroy", elapsed * 1e3);
+	}
+}
+
+/**
+ * Size of the largest free region in the heap.
+ */
+static size_t largest_free_region()
+{
+	size_t largest = 0;
+	char *hp = NEXT_WORD(heap->prologue_footer);
+	while (hp != (char*)heap->epilogue_header)
+	{
+		if (GET_ALLOC(hp) == FREE && GET_REGION_SIZE(hp) > largest)
+			largest = GET_REGION_SIZE(hp);
+		hp += GET_REGION_SIZE(hp);
+	}
+	return largest;
+}
+
+/**
+ * Fragment the heap with a cache of handles where every other entry is
+ * evicted, then compact it.
+ */
+static void bench_compact()
+{
+	#define CACHE_ENTRIES 16384
+
+	static sf_handle cache[CACHE_ENTRIES];
+	srand(1);
+	int i;
+	for (i = 0; i < CACHE_ENTRIES; i++)
+		cache[i] = sf_halloc(64 + rand() % 1024);
+	for (i = 0; i < CACHE_ENTRIES; i += 2)
+		sf_hfree(cache[i]);
+
+	size_t before = largest_free_region();
+	size_t heap_before = heap->heap_size;
+
+	double start = now();
+	size_t moved = sf_compact(SF_COMPACT_TRIM);
+	double elapsed = now() - start;
+
+	printf("compact: moved=%lu bytes in %.3fms, largest free region %lu -> %lu, heap %lu -> %lu\n",
+		moved, elapsed * 1e3, before, largest_free_region(), heap_before, heap->heap_size);
+
+	for (i = 1; i < CACHE_ENTRIES; i += 2)
+		sf_hfree(cache[i]);
+}
+
+/**
+ * Cost of polling sf_stats on a fragmented heap, against walking it.
+ */
+static void bench_stats()
+{
+	#define STATS_REGIONS 65536
+	#define STATS_POLLS 100
+
+	static void *regions[STATS_REGIONS];
+	srand(1);
+	int i;
+	for (i = 0; i < STATS_REGIONS; i++)
+		regions[i] = sf_malloc(16 + rand() % 512);
+	for (i = 0; i < STATS_REGIONS; i += 2)
+		sf_free(regions[i]);
+
+	struct sf_stats stats;
+	double start = now();
+	for (i = 0; i < STATS_POLLS; i++)
+		sf_stats(&stats);
+	double polled = (now() - start) / STATS_POLLS;
+
+	start = now();
+	for (i = 0; i < STATS_POLLS; i++)
+		largest_free_region();
+	double walked = (now() - start) / STATS_POLLS;
+
+	printf("stats: sf_stats=%.1fus heap walk=%.1fus\n", polled * 1e6, walked * 1e6);
+	printf("stats: requested=%lu allocated=%lu free=%lu in %lu regions, largest=%lu fragmentation=%.3f\n",
+		stats.requested_bytes, stats.allocated_bytes, stats.free_bytes, stats.free_regions,
+		stats.largest_free_region, stats.fragmentation);
+	printf("stats: extends=%lu (%lu bytes) coalesce cases=%lu/%lu/%lu/%lu probes per find_fit=%.1f\n",
+		stats.extend_calls, stats.extend_bytes, stats.coalesce_cases[0], stats.coalesce_cases[1],
+		stats.coalesce_cases[2], stats.coalesce_cases[3], stats.find_fit_probes);
+
+	for (i = 1; i < STATS_REGIONS; i += 2)
+		sf_free(regions[i]);
+}
+
+/**
+ * Cost of heap profile sampling on a malloc and free loop, off, at the
+ * default rate, and at a rate that samples far more often.
+ */
+static void bench_sampling()
+{
+	#define SAMPLING_WINDOW 1024
+	#define SAMPLING_OPS 2000000
+
+	static void *window[SAMPLING_WINDOW];
+	static size_t sizes[SAMPLING_WINDOW];
+	// The first round only warms the heap up.
+	size_t rates[] = { 0, 0, SF_SAMPLE_DEFAULT_RATE, 4096 };
+	size_t round;
+	for (round = 0; round < sizeof(rates) / sizeof(rates[0]); round++)
+	{
+		sf_mallopt(SF_SAMPLE_RATE, rates[round]);
+
+		srand(1);
+		int i;
+		double start = now();
+		for (i = 0; i < SAMPLING_OPS; i++)
+		{
+			int j = i % SAMPLING_WINDOW;
+			if (window[j] != NULL)
+				sf_free_sized(window[j], sizes[j]);
+			sizes[j] = 16 + rand() % 512;
+			window[j] = sf_malloc(sizes[j]);
+		}
+		double elapsed = now() - start;
+
+		if (round > 0)
+			printf("sampling: rate=%7lu %6.1fns per malloc and free, %lu live samples\n",
+				rates[round], elapsed / SAMPLING_OPS * 1e9, sample_count);
+
+		for (i = 0; i < SAMPLING_WINDOW; i++)
+		{
+			sf_free_sized(window[i], sizes[i]);
+			window[i] = NULL;
+		}
+	}
+
+	sf_mallopt(SF_SAMPLE_RATE, 0);
+}
+
+/**
+ * Cost of tagging on a malloc and free loop, against plain sf_malloc.
+ */
+static void bench_tags()
+{
+	#define TAGS_WINDOW 1024
+	#define TAGS_OPS 2000000
+
+	static void *window[TAGS_WINDOW];
+	static size_t sizes[TAGS_WINDOW];
+	int round;
+	for (round = 0; round < 3; round++)
+	{
+		srand(1);
+		int i;
+		double start = now();
+		for (i = 0; i < TAGS_OPS; i++)
+		{
+			int j = i % TAGS_WINDOW;
+			if (window[j] != NULL)
+				sf_free_sized(window[j], sizes[j]);
+			sizes[j] = 16 + rand() % 512;
+			window[j] = round == 2 ? sf_malloc_tagged(sizes[j], 1 + j % 8) : sf_malloc(sizes[j]);
+		}
+		double elapsed = now() - start;
+
+		// The first round only warms the heap up.
+		if (round > 0)
+			printf("tags: %-8s %6.1fns per malloc and free\n", round == 1 ? "untagged" : "tagged", elapsed / TAGS_OPS * 1e9);
+
+		for (i = 0; i < TAGS_WINDOW; i++)
+		{
+			sf_free_sized(window[i], sizes[i]);
+			window[i] = NULL;
+		}
+	}
+
+	struct sf_tag_stats stats;
+	sf_tag_stats(1, &stats);
+	printf("tags: tag 1 live=%lu peak=%lu allocations=%lu\n", stats.live_bytes, stats.peak_bytes, stats.allocations);
+}
+
+static void bench_trace()
+{
+	#define TRACE_WINDOW 1024
+	#define TRACE_OPS 2000000
+
+	static void *window[TRACE_WINDOW];
+	static size_t sizes[TRACE_WINDOW];
+	long dropped = 0;
+	int fd = open("/dev/null", O_WRONLY);
+	int round;
+	for (round = 0; round < 3; round++)
+	{
+		// The events go nowhere, so this times only the recording.
+		if (round == 2 && sf_trace_start(fd) != 0)
+			break;
+
+		srand(1);
+		int i;
+		double start = now();
+		for (i = 0; i < TRACE_OPS; i++)
+		{
+			int j = i % TRACE_WINDOW;
+			if (window[j] != NULL)
+				sf_free_sized(window[j], sizes[j]);
+			sizes[j] = 16 + rand() % 512;
+			window[j] = sf_malloc(sizes[j]);
+		}
+		double elapsed = now() - start;
+
+		if (round == 2)
+			dropped = sf_trace_stop();
+
+		// The first round only warms the heap up.
+		if (round > 0)
+			printf("trace: %-8s %6.1fns per malloc and free\n", round == 1 ? "off" : "on", elapsed / TRACE_OPS * 1e9);
+
+		for (i = 0; i < TRACE_WINDOW; i++)
+		{
+			sf_free_sized(window[i], sizes[i]);
+			window[i] = NULL;
+		}
+	}
+
+	close(fd);
+	printf("trace: %ld of %d events dropped\n", dropped, 2 * TRACE_OPS);
+}
+
+static void bench_policy()
+{
+	#define POLICY_WINDOW 4096
+	#define POLICY_OPS 1000000
+
+	static const struct { const char *name; int policy; } policies[] =
+	{
+		{ "lifo", 0 },
+		{ "next", SF_POLICY_NEXT },
+		{ "best", SF_POLICY_BEST },
+		{ "address", SF_POLICY_ADDRESS },
+		{ "address+next", SF_POLICY_ADDRESS | SF_POLICY_NEXT },
+		{ "address+best", SF_POLICY_ADDRESS | SF_POLICY_BEST },
+		{ "auto", SF_POLICY_AUTO },
+	};
+	static void *window[POLICY_WINDOW];
+	static size_t sizes[POLICY_WINDOW];
+
+	size_t p;
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+	{
+		sf_mallopt(SF_POLICY, policies[p].policy);
+		struct sf_stats before;
+		sf_stats(&before);
+
+		// Every eighth slot holds up to 4 KB and the rest small objects, all
+		// freed at random, so the free space gets chopped up.
+		srand(1);
+		int i;
+		double start = now();
+		for (i = 0; i < POLICY_OPS; i++)
+		{
+			int j = rand() % POLICY_WINDOW;
+			if (window[j] != NULL)
+				sf_free_sized(window[j], sizes[j]);
+			sizes[j] = j % 8 == 0 ? 16 + rand() % 4096 : 16 + rand() % 128;
+			window[j] = sf_malloc(sizes[j]);
+		}
+		double elapsed = now() - start;
+
+		struct sf_stats stats;
+		sf_stats(&stats);
+		printf("policy: %-12s %6.1fns per malloc and free, fragmentation=%.3f switches=%lu\n", policies[p].name,
+			elapsed / POLICY_OPS * 1e9, stats.fragmentation, stats.policy_switches - before.policy_switches);
+
+		for (i = 0; i < POLICY_WINDOW; i++)
+		{
+			sf_free_sized(window[i], sizes[i]);
+			window[i] = NULL;
+		}
+	}
+
+	sf_mallopt(SF_POLICY, DEFAULT_POLICY);
+}
+
+#define CLASSES_WINDOW 4096
+#define CLASSES_OPS 1000000
+
+/**
+ * The mix of bench policy, with every object freed at the end.
+ * @param stats Filled in with the counters before the objects are freed.
+ * @return The time it took.
+ */
+static double run_classes_mix(struct sf_stats *stats)
+{
+	static void *window[CLASSES_WINDOW];
+	static size_t sizes[CLASSES_WINDOW];
+
+	srand(1);
+	int i;
+	double start = now();
+	for (i = 0; i < CLASSES_OPS; i++)
+	{
+		int j = rand() % CLASSES_WINDOW;
+		if (window[j] != NULL)
+			sf_free_sized(window[j], sizes[j]);
+		sizes[j] = j % 8 == 0 ? 16 + rand() % 4096 : 16 + rand() % 128;
+		window[j] = sf_malloc(sizes[j]);
+	}
+	double elapsed = now() - start;
+
+	sf_stats(stats);
+	for (i = 0; i < CLASSES_WINDOW; i++)
+	{
+		sf_free_sized(window[i], sizes[i]);
+		window[i] = NULL;
+	}
+	return elapsed;
+}
+
+/**
+ * The waste of 16 byte rounding against the size class table compiled in.
+ * make sizeclasses fits that table to this benchmark's own requests:
+ * SFMM_TRACE=<file> traces one more run, untimed, for ./classes.
+ */
+static void bench_classes()
+{
+	struct sf_stats stats;
+	const char *path = getenv("SFMM_TRACE");
+	if (path != NULL && *path != '\0')
+	{
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || sf_trace_start(fd) != 0)
+		{
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		run_classes_mix(&stats);
+		printf("classes: traced to %s, %ld events dropped\n", path, sf_trace_stop());
+		close(fd);
+	}
+
+	int on;
+	for (on = 0; on < 2; on++)
+	{
+		sf_mallopt(SF_SIZE_CLASSES, on);
+		double elapsed = run_classes_mix(&stats);
+		printf("classes: %-4s %6.1fns per malloc and free, %.1f%% over requested, fragmentation=%.3f\n", on ? "on" : "off",
+			elapsed / CLASSES_OPS * 1e9, 100.0 * (stats.allocated_bytes - stats.requested_bytes) / stats.requested_bytes, stats.fragmentation);
+	}
+
+	sf_mallopt(SF_SIZE_CLASSES, 0);
+}
+
+/**
+ * Freeing and allocating one small size over and over with the fast bins off
+ * and on, next to a long free list of holes that never coalesce.
+ */
+static void bench_fast_bins()
+{
+	#define FAST_BINS_HOLES 1024
+	#define FAST_BINS_WINDOW 64
+	#define FAST_BINS_OPS 200000
+
+	static void *holes[2 * FAST_BINS_HOLES];
+	static void *window[FAST_BINS_WINDOW];
+	const int policies[] = { 0, SF_POLICY_ADDRESS, SF_POLICY_ADDRESS | SF_POLICY_BEST };
+	const char *names[] = { "lifo", "address", "address best" };
+
+	int p, on;
+	for (p = 0; p < 3; p++)
+	{
+		for (on = 0; on < 2; on++)
+		{
+			sf_mallopt(SF_POLICY, policies[p]);
+			sf_mallopt(SF_FAST_BINS, on ? FAST_BIN_MAX : 0);
+
+			// Every other region freed: holes of mixed sizes with allocated neighbours.
+			int i;
+			for (i = 0; i < 2 * FAST_BINS_HOLES; i++)
+				holes[i] = sf_malloc(64 + i % 16 * 16);
+			for (i = 1; i < 2 * FAST_BINS_HOLES; i += 2)
+				sf_free_sized(holes[i], 64 + i % 16 * 16);
+
+			double start = now();
+			for (i = 0; i < FAST_BINS_OPS; i++)
+			{
+				int j = i % FAST_BINS_WINDOW;
+				if (window[j] != NULL)
+					sf_free_sized(window[j], 48);
+				window[j] = sf_malloc(48);
+			}
+			double elapsed = now() - start;
+
+			printf("fast_bins: %-12s %-3s %6.1fns per malloc and free\n", names[p], on ? "on" : "off", elapsed / FAST_BINS_OPS * 1e9);
+
+			for (i = 0; i < FAST_BINS_WINDOW; i++)
+			{
+				sf_free_sized(window[i], 48);
+				window[i] = NULL;
+			}
+			for (i = 0; i < 2 * FAST_BINS_HOLES; i += 2)
+				sf_free_sized(holes[i], 64 + i % 16 * 16);
+		}
+	}
+
+	sf_mallopt(SF_FAST_BINS, 0);
+	sf_mallopt(SF_POLICY, DEFAULT_POLICY);
+}
+
+static struct benchmark benchmarks[] =
+{
+	{ "tlb", bench_tlb },
+	{ "realloc", bench_realloc },
+	{ "reserve", bench_reserve },
+	{ "calloc", bench_calloc },
+	{ "comalloc", bench_comalloc },
+	{ "free_sized", bench_free_sized },
+	{ "append", bench_append },
+	{ "arena", bench_arena },
+	{ "heap_destroy", bench_heap_destroy },
+	{ "compact", bench_compact },
+	{ "stats", bench_stats },
+	{ "sampling", bench_sampling },
+	{ "tags", bench_tags },
+	{ "trace", bench_trace },
+	{ "policy", bench_policy },
+	{ "classes", bench_classes },
+	{ "fast_bins", bench_fast_bins },
+};
+
+int main(int argc, char *argv[])
+{
+	sf_mem_init();
+
+	int found = 0;
+	size_t i;
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+	{
+		if (argc > 1 && strcmp(argv[1], benchmarks[i].name) != 0)
+			continue;
+		benchmarks[i].run();
+		found = 1;
+	}
+
+	if (!found)
+	{
+		fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
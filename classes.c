@@ -0,0 +1,307 @@
+#include "include/sfmm.h"
+#include "include/sfmm_classes.h"
+
+/**
+ * Fits a size class table to the requests in traces from sf_trace_start.
+ *
+ * ./classes <count> <trace>... > include/sfmm_classes.h
+ *
+ * The table has at most count classes and the least internal fragmentation
+ * any table that size can have on the traced requests. It is written to
+ * stdout as the header the allocator builds with, and the waste it leaves is
+ * compared with the compiled-in table's on stderr.
+ *
+ * Only the header is included, not the allocator, so everything here runs on
+ * the C library's malloc.
+ */
+
+/* Slots of the histogram, one per 16 byte step of region size up to the large threshold */
+#define HISTOGRAM_SIZE (REGION_SIZE(LARGE_THRESHOLD - 1) / 16 + 1)
+
+/* Classes a line of the generated table holds */
+#define CLASSES_PER_LINE 8
+
+static int64_t histogram[HISTOGRAM_SIZE];	// allocations by region size / 16
+static int64_t requested_bytes = 0;
+static int64_t allocations = 0;
+
+/* The distinct region sizes, and prefix sums of their counts and bytes, indexed from 1 */
+static int n = 0;
+static int64_t *sizes;
+static int64_t *counts;
+static int64_t *bytes;
+
+static int64_t *previous;	// least waste covering sizes 1..j with one class fewer
+static int64_t *current;
+static int *choice;			// choice[k * (n + 1) + j]: the size below class k when it ends at size j
+
+static bool count_trace(const char *path);
+static int fit(int max_classes, int64_t *classes);
+static void solve(int k, int lo, int hi, int opt_lo, int opt_hi);
+static int64_t waste(int i, int j);
+static int64_t table_waste(const int64_t *classes, int count);
+static void print_waste(const char *name, const int64_t *classes, int count);
+static void print_table(const int64_t *classes, int count, int argc, char *argv[]);
+
+int main(int argc, char *argv[])
+{
+	int max_classes = argc >= 3 ? atoi(argv[1]) : 0;
+	if (max_classes <= 0)
+	{
+		fprintf(stderr, "usage: %s <count> <trace>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int i;
+	for (i = 2; i < argc; i++)
+	{
+		if (!count_trace(argv[i]))
+			return EXIT_FAILURE;
+	}
+
+	if (allocations == 0)
+	{
+		fprintf(stderr, "no heap allocations in the traces\n");
+		return EXIT_FAILURE;
+	}
+
+	int64_t *classes = malloc(max_classes * sizeof(int64_t));
+	int count = fit(max_classes, classes);
+
+	int64_t default_classes[SIZE_CLASS_COUNT];
+	for (i = 0; i < SIZE_CLASS_COUNT; i++)
+		default_classes[i] = size_classes[i];
+
+	fprintf(stderr, "classes: %ld allocations of %ld bytes below the large threshold\n", allocations, requested_bytes);
+	print_waste("fitted", classes, count);
+	print_waste("default", default_classes, SIZE_CLASS_COUNT);
+	print_waste("none", NULL, 0);
+
+	print_table(classes, count, argc, argv);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Add the heap allocations of one trace to the histogram.
+ * @return false after printing why the trace could not be read.
+ */
+static bool count_trace(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		perror(path);
+		return false;
+	}
+
+	struct sf_trace_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != SF_TRACE_MAGIC)
+	{
+		fprintf(stderr, "%s: not a trace\n", path);
+		fclose(f);
+		return false;
+	}
+
+	if (header.version != SF_TRACE_VERSION || header.event_size != sizeof(struct sf_trace_event))
+	{
+		fprintf(stderr, "%s: trace version %d, expected %d\n", path, header.version, SF_TRACE_VERSION);
+		fclose(f);
+		return false;
+	}
+
+	// Order does not matter here, so there is no need to sort by seq.
+	struct sf_trace_event events[256];
+	size_t got;
+	while ((got = fread(events, sizeof(struct sf_trace_event), 256, f)) > 0)
+	{
+		size_t i;
+		for (i = 0; i < got; i++)
+		{
+			struct sf_trace_event *e = &events[i];
+			int64_t size;
+			switch (e->op)
+			{
+				case SF_TRACE_MALLOC:
+				case SF_TRACE_REALLOC:
+					size = e->size;
+					break;
+				case SF_TRACE_CALLOC:
+					size = e->arg < LARGE_THRESHOLD && e->size < LARGE_THRESHOLD ? e->arg * e->size : LARGE_THRESHOLD;
+					break;
+				default:
+					// Aligned allocations and frees are not rounded to classes.
+					continue;
+			}
+
+			// Failed, empty and large allocations never reach a size class.
+			if (e->ptr == 0 || size <= 0 || size >= LARGE_THRESHOLD)
+				continue;
+
+			histogram[REGION_SIZE(size) / 16]++;
+			requested_bytes += size;
+			allocations++;
+		}
+	}
+
+	fclose(f);
+	return true;
+}
+
+/**
+ * Pick at most max_classes region sizes that waste the least on the
+ * histogram. Only sizes that were asked for can be classes: any other class
+ * could move down to the next one asked for and waste less.
+ * @return the number of classes put in classes, smallest first.
+ */
+static int fit(int max_classes, int64_t *classes)
+{
+	int slot;
+	for (slot = 0; slot < HISTOGRAM_SIZE; slot++)
+	{
+		if (histogram[slot] != 0)
+			n++;
+	}
+
+	sizes = calloc(n + 1, sizeof(int64_t));
+	counts = calloc(n + 1, sizeof(int64_t));
+	bytes = calloc(n + 1, sizeof(int64_t));
+	int j = 0;
+	for (slot = 0; slot < HISTOGRAM_SIZE; slot++)
+	{
+		if (histogram[slot] == 0)
+			continue;
+		j++;
+		sizes[j] = slot * 16;
+		counts[j] = counts[j - 1] + histogram[slot];
+		bytes[j] = bytes[j - 1] + histogram[slot] * sizes[j];
+	}
+
+	int k_max = max_classes < n ? max_classes : n;
+	previous = calloc(n + 1, sizeof(int64_t));
+	current = calloc(n + 1, sizeof(int64_t));
+	choice = calloc((size_t)(k_max + 1) * (n + 1), sizeof(int));
+
+	// One class has to be the largest size asked for, and covers everything.
+	for (j = 1; j <= n; j++)
+		previous[j] = waste(0, j);
+
+	// Each added class ends at size j and starts above the size the best
+	// table with one class fewer ended at. That size only moves up as j does,
+	// which lets solve split the range instead of trying every pair.
+	int k;
+	for (k = 2; k <= k_max; k++)
+	{
+		solve(k, k, n, k - 1, n - 1);
+		int64_t *swap = previous;
+		previous = current;
+		current = swap;
+	}
+
+	// Walk the choices back down from the largest class.
+	j = n;
+	for (k = k_max; k >= 1; k--)
+	{
+		classes[k - 1] = sizes[j];
+		j = k > 1 ? choice[k * (n + 1) + j] : 0;
+	}
+
+	return k_max;
+}
+
+/**
+ * Fill current[lo..hi] with the least waste covering sizes 1..j with k
+ * classes, knowing the class below the last ends between opt_lo and opt_hi.
+ */
+static void solve(int k, int lo, int hi, int opt_lo, int opt_hi)
+{
+	if (lo > hi)
+		return;
+
+	int mid = (lo + hi) / 2;
+	int last = mid - 1 < opt_hi ? mid - 1 : opt_hi;
+	int64_t best = INT64_MAX;
+	int best_i = opt_lo;
+	int i;
+	for (i = opt_lo; i <= last; i++)
+	{
+		int64_t total = previous[i] + waste(i, mid);
+		if (total < best)
+		{
+			best = total;
+			best_i = i;
+		}
+	}
+
+	current[mid] = best;
+	choice[k * (n + 1) + mid] = best_i;
+
+	solve(k, lo, mid - 1, opt_lo, best_i);
+	solve(k, mid + 1, hi, best_i, opt_hi);
+}
+
+/**
+ * Bytes lost rounding sizes i+1..j up to a class of size j.
+ */
+static int64_t waste(int i, int j)
+{
+	return sizes[j] * (counts[j] - counts[i]) - (bytes[j] - bytes[i]);
+}
+
+/**
+ * Bytes beyond what was requested that the histogram takes up with classes,
+ * counting headers, footers and padding. Sizes above the largest class stay
+ * as they are, like in the allocator.
+ */
+static int64_t table_waste(const int64_t *classes, int count)
+{
+	int64_t total = 0;
+	int c = 0;
+	int slot;
+	for (slot = 0; slot < HISTOGRAM_SIZE; slot++)
+	{
+		int64_t size = slot * 16;
+		while (c < count && classes[c] < size)
+			c++;
+		total += histogram[slot] * (c < count ? classes[c] : size);
+	}
+	return total - requested_bytes;
+}
+
+static void print_waste(const char *name, const int64_t *classes, int count)
+{
+	int64_t total = table_waste(classes, count);
+	fprintf(stderr, "classes: %-8s %3d classes, %ld bytes wasted (%.1f%% of requested)\n",
+		name, count, total, 100.0 * total / requested_bytes);
+}
+
+/**
+ * Write the table as include/sfmm_classes.h.
+ */
+static void print_table(const int64_t *classes, int count, int argc, char *argv[])
+{
+	printf("/**\n");
+	printf(" * Size classes: region sizes, header and footer included, that heap\n");
+	printf(" * requests are rounded up to when SF_SIZE_CLASSES is on. Generated with:\n");
+	printf(" *\n");
+	printf(" *");
+	int i;
+	for (i = 0; i < argc; i++)
+		printf(" %s", argv[i]);
+	printf("\n");
+	printf(" *\n");
+	printf(" * Fitted to %ld allocations, it wastes %ld bytes on them.\n", allocations, table_waste(classes, count));
+	printf(" */\n");
+	printf("\n");
+	printf("#ifndef __SFMM_CLASSES_H\n");
+	printf("#define __SFMM_CLASSES_H\n");
+	printf("\n");
+	printf("#define SIZE_CLASS_COUNT %d\n", count);
+	printf("\n");
+	printf("static const int32 size_classes[SIZE_CLASS_COUNT] =\n");
+	printf("{");
+	for (i = 0; i < count; i++)
+		printf("%s%ld,", i % CLASSES_PER_LINE == 0 ? "\n\t" : " ", classes[i]);
+	printf("\n};\n");
+	printf("\n");
+	printf("#endif\n");
+}
@@ -6,13 +6,28 @@
 #ifndef __SFMM_H
 #define __SFMM_H
 
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE	// mremap
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "sfmm_api.h"
 
 /* Easy ints */
 #define int8 uint8_t
@@ -20,12 +35,38 @@
 #define int64 uint64_t
 
 #define FOUR_KB 4096
+#define TWO_MB 2097152
 #define FOUR_GB 4294967296
 #define MAX 4294967288
 
+/* Once the free region at the top of the heap grows past this, sf_free gives the excess back */
+#define TRIM_THRESHOLD (128 * 1024)
+/* Bytes of the top free region that are never given back when trimming */
+#define TRIM_KEEP FOUR_KB
+
+/* sf_calloc zeroes payloads this big with non-temporal stores so they do not evict the cache */
+#define NT_ZERO_THRESHOLD (1024 * 1024)
+
+/* With -DDEFERRED, frees wait in a pending list and are coalesced this many at a time */
+#define DEFERRED_THRESHOLD 128
+
+/* Largest request sf_mallopt(SF_FAST_BINS, ...) accepts */
+#define FAST_BIN_MAX 256
+/* Fast bins, one per region size up to REGION_SIZE(FAST_BIN_MAX), indexed by region size / 16 */
+#define FAST_BIN_COUNT (REGION_SIZE(FAST_BIN_MAX) / 16 + 1)
+/* Regions one fast bin holds before every bin is consolidated into the free list */
+#define FAST_BIN_LIMIT 64
+
+/* Requests of at least this many bytes get their own mapping. Tunable with sf_mallopt */
+#define LARGE_THRESHOLD (128 * 1024)
+
+/* Round an address or size up/down to a multiple of align, which must be a power of two */
+#define ALIGN_UP(p, align)		(((uintptr_t)(p) + ((align) - 1)) & ~((uintptr_t)(align) - 1))
+#define ALIGN_DOWN(p, align)	((uintptr_t)(p) & ~((uintptr_t)(align) - 1))
+
 /* Basic constants and macros */
 #define WSIZE 	8	// Word and header/footer size in Bytes
-#define DSIZE	16	// long double size in Bytes
+#define DSIZE	SF_ALIGNMENT	// long double size in Bytes
 #define MIN_REGION_SIZE ((DSIZE) + (WSIZE) + (WSIZE)) // long double + header + footer
 
 /* Given a requested size, return how big the region including padding, header, and footer should be */
@@ -35,11 +76,23 @@
 #define ALLOCATED 0x1
 #define FREE 	  0x0
 
+/* large bit l. Only set on large objects, which live in their own mapping outside the heap */
+#define LARGE	  0x2
+
+/* zero bit z. Only set on free regions whose payload is known to be zero apart from the forward and back links */
+#define ZERO	  0x4
+
+/* tag bit t. The same bit as z, but only set on allocated regions from sf_malloc_tagged. Their footer or large segment holds the tag */
+#define TAGGED	  0x4
+
+/* growing bit g. Only set on allocated regions that sf_realloc has grown, so the next growth can be over-provisioned */
+#define GROWING	  0x8
+
 /* Pack the requested size, actual region size, and allocation bit into one word */
 /* Use this to create the header/footer of a region */
 /*
-	|=================================|==============================|00a|	- 64 bit
-			32-bit Requested Size 				29-bit Region size  	  	allocated bit
+	|=================================|=============================|gzla|	- 64 bit
+			32-bit Requested Size 				28-bit Region size  	  	growing bit, zero bit, large bit, allocated bit
  */
 #define PACK(requested_size, region_size, a) (((region_size) | (a)) | (((requested_size) << 16) << 16) )	
 
@@ -51,9 +104,19 @@
 /* Given a pointer to header or footer hp, return the requested_size */
 #define GET_REQUESTED_SIZE(hp)	(GET(hp) >> 32)
 /* Given a header or footer h, return the actual region size */
-#define GET_REGION_SIZE(hp)		(GET(hp) & 0xFFFFFFF8)
+#define GET_REGION_SIZE(hp)		(GET(hp) & 0xFFFFFFF0)
 /* Given a header or footer h, return the allocated bit */
 #define GET_ALLOC(hp) 			(GET(hp) & 0x1)		
+/* Given a header h, return the large bit */
+#define GET_LARGE(hp)			(GET(hp) & LARGE)
+/* Given a header or footer h of a free region, return the zero bit */
+#define GET_ZERO(hp)			(GET(hp) & ZERO)
+/* Given a header h of an allocated region, return the growing bit */
+#define GET_GROWING(hp)			(GET(hp) & GROWING)
+/* Given a header h of an allocated region, return the tag bit */
+#define GET_TAGGED(hp)			(GET(hp) & TAGGED)
+/* Given the footer of a tagged region, return its tag */
+#define GET_TAG(fp)				(GET(fp) >> 32)
 
 /* Given an address to region rp, return address of header */
 #define HEADER_ADDRESS(rp)	((char*)(rp) - WSIZE)
@@ -62,7 +125,7 @@
 /* Given an address, return address of word after. Used to get the region pointer and the freelist pointer */ 
 #define NEXT_WORD(p)		((char*)(p) + WSIZE)
 /* Given an address, return address of word before. */
-#define PREV_WORD(p)		((char*)(p) + WSIZE)
+#define PREV_WORD(p)		((char*)(p) - WSIZE)
 
 /* Given an address to region rp, compute address of next and previous regions */ 
 #define NEXT_REGION(rp)	((char *)(rp) + GET_REGION_SIZE(((char *)(rp) - WSIZE)))
@@ -78,56 +141,223 @@
 /* Only use these on free heads */
 #define FORWARD_LINK(hp)	NEXT_WORD(hp)
 #define BACK_LINK(hp)		NEXT_WORD(NEXT_WORD(hp))
+
 /**
- * This routine will initialize your memory allocator. It is called the
- * `_start` function which is called before main is called.
+ * Every large object mapping starts with one of these. The header is the word
+ * right before the payload, so HEADER_ADDRESS works on large objects too:
+ * PACK(requested_size, payload offset, LARGE | ALLOCATED).
+ * The payload offset is 64 bytes, or the alignment for sf_aligned_alloc.
+ * Large objects have no footer; they never take part in coalescing.
  */
-void sf_mem_init(void);
+struct large_segment
+{
+	struct large_segment *next;	// doubly linked list of live large objects
+	struct large_segment *prev;
+	size_t map_size;			// bytes mapped, including this struct
+	size_t tag;					// tag of a TAGGED large object
+	char *payload;				// what was handed out, and its key in the large object table
+	struct sf_heap *heap;		// the heap whose large_list it is on
+};
+
+/* Offset of the payload into a large object mapping, for the given alignment */
+#define LARGE_PAYLOAD_OFFSET(align)	ALIGN_UP(sizeof(struct large_segment) + WSIZE, (align))
+
+/* Given the address of a large object rp, return its segment */
+#define LARGE_SEGMENT(rp)	((struct large_segment *)((char *)(rp) - GET_REGION_SIZE(HEADER_ADDRESS(rp))))
+
+/* Address space reserved for a heap created with a max_size of 0 */
+#define HEAP_DEFAULT_RESERVE (1024L * 1024 * 1024)
 
 /**
- * This is your implementation of malloc. It creates dynamic memory which
- * is aligned and padded properly for the underlying system. This memory
- * is uninitialized.
- * @param size The number of bytes requested to be allocated.
- * @return If successful, the pointer to a valid region of memory
- * to use is returned, else the value NULL is returned and the
- * ERRNO is set accordingly. If size is set to zero, then the
- * value NULL is returned.
+ * All the state of one heap. The default heap grows with sbrk. Heaps from
+ * sf_heap_create grow inside their own reserved mapping instead, which
+ * starts with this struct.
  */
-void* sf_malloc(size_t size);
+struct sf_heap
+{
+	int64 *prologue_header;
+	int64 *prologue_footer;
+	int64 *epilogue_header;
+
+	int64 *heap_start;	// always points to the start of the heap
+	size_t heap_size;	// size of the heap
+
+	int64 *freelist_pointer;	// pointer to head of start of explicit freelist
+								// with SF_POLICY_ADDRESS, this always points to the first
+								// free region in address order.
+								// NULL when there are no free regions.
+
+	int64 *next_free_pointer; // pointer that points to the free region after the one we just allocated
+
+	int policy;					// SF_POLICY_* flags
+	size_t policy_switches;		// times the policy changed
+	size_t tuned_calls;			// find_fit_calls and find_fit_probes when SF_POLICY_AUTO last looked
+	size_t tuned_probes;
+	size_t tuned_largest;		// largest region find_fit handed out since then
+
+	size_t largest_free;		// never below the largest free region, and exact unless
+	bool largest_free_dirty;	// a region that large left the free list since sf_stats looked
+
+	#ifdef HUGEPAGE
+		char *touched_top;	// end of the highest region ever handed out. Huge pages below this are already faulted in.
+	#endif
+
+	#ifdef DEFERRED
+		int64 *pending[DEFERRED_THRESHOLD];	// payloads freed but not yet coalesced. Still marked allocated.
+		size_t pending_count;
+		size_t pending_bytes;
+	#endif
+
+	int64 *fast_bins[FAST_BIN_COUNT];	// freed small regions by size, still marked allocated, linked through their payloads
+	size_t fast_bin_counts[FAST_BIN_COUNT];
+	size_t fast_bin_regions;			// regions in all the fast bins
+	size_t fast_bin_bytes;
+
+	char *reserve_floor;	// trim_heap never lowers the top of the heap below this
+	char *zero_floor;		// everything from here to the epilogue is zero, apart from the top free region's tags and links
+
+	struct large_segment *large_list;	// live large objects
+	size_t large_bytes;					// bytes mapped for large objects
+
+	size_t requested_bytes;		// counters behind sf_stats, kept up to date as regions change
+	size_t allocated_bytes;
+	size_t fence_bytes;
+	size_t free_regions;
+	size_t extend_calls;
+	size_t extend_bytes;
+	size_t coalesce_cases[4];
+	size_t find_fit_calls;
+	size_t find_fit_probes;
 
-/** Marks a dynamically allocated region as no longer in use.
- * @param ptr Address of memory returned by the function sf_malloc,
- * sf_realloc, or sf_calloc.
+	struct sf_tag_stats tags[SF_MAX_TAGS];	// indexed by tag. Entry 0 is unused.
+
+	char *brk;				// break inside the reserved mapping. NULL for the default heap.
+	char *brk_limit;		// end of the reserved mapping
+	struct sf_heap *next;	// every heap, starting at the default heap, for the limits
+};
+
+/* Records sf_heap_dump buffers on the stack between writes */
+#define DUMP_BUFFER_RECORDS 256
+
+/* Events each thread's trace ring holds. A power of two */
+#define TRACE_RING_EVENTS (1 << 16)
+
+/* How often the flusher thread empties the trace rings */
+#define TRACE_FLUSH_INTERVAL_US 1000
+
+/**
+ * Single producer, single consumer ring of one thread's events. The thread
+ * only moves head, the flusher only moves tail, so neither takes a lock.
+ */
+struct sf_trace_ring
+{
+	struct sf_trace_ring *next;	// every thread's ring, newest first
+	int32 thread;
+	size_t head;				// events written, ever
+	size_t tail;				// events flushed, ever
+	size_t dropped;				// events lost because the ring was full
+	struct sf_trace_event events[TRACE_RING_EVENTS];
+};
+
+/**
+ * One entry of the handle table, indexed by handle.
+ */
+struct sf_handle_entry
+{
+	void *ptr;		// current address of the payload. NULL for an unused entry.
+	size_t pins;	// pin count, or the next unused entry when ptr is NULL
+};
+
+/* Bytes in front of a handle's payload. The first word holds the handle, so sf_compact can find its entry */
+#define HANDLE_PREFIX DSIZE
+
+/* Most threads sf_reserve will use to prefault */
+#define MAX_PREFAULT_THREADS 16
+
+/* Most pressure callbacks that can be registered at once */
+#define MAX_PRESSURE_CALLBACKS 8
+
+/* Chunk size for arenas created with an initial size of 0 */
+#define ARENA_DEFAULT_CHUNK FOUR_KB
+/* Arena chunks stop doubling once they reach this size */
+#define ARENA_MAX_CHUNK (1024 * 1024)
+
+/**
+ * Every arena chunk starts with one of these. Chunks are ordinary allocations,
+ * chained newest first.
  */
-void sf_free(void *ptr);
+struct sf_arena_chunk
+{
+	struct sf_arena_chunk *prev;	// the chunk that filled up before this one
+	char *end;						// end of the usable memory of this chunk
+};
+
+/**
+ * A bump pointer arena. It lives in its first chunk, right after the chunk header.
+ */
+struct sf_arena
+{
+	struct sf_arena_chunk *chunk;	// newest chunk, which allocations come from
+	char *top;						// next free byte in chunk
+	size_t next_chunk_size;			// doubles every time a chunk is chained in, up to ARENA_MAX_CHUNK
+	size_t pad;						// keeps allocations 16 byte aligned
+};
+
+/* The policy heaps start with, from the -DADDRESS, -DNEXT and -DBEST build flags */
+#if defined(BEST) && defined(NEXT)
+	#error "-DBEST and -DNEXT are two placements, pick one"
+#elif defined(ADDRESS) && defined(BEST)
+	#define DEFAULT_POLICY (SF_POLICY_ADDRESS | SF_POLICY_BEST)
+#elif defined(BEST)
+	#define DEFAULT_POLICY SF_POLICY_BEST
+#elif defined(ADDRESS) && defined(NEXT)
+	#define DEFAULT_POLICY (SF_POLICY_ADDRESS | SF_POLICY_NEXT)
+#elif defined(ADDRESS)
+	#define DEFAULT_POLICY SF_POLICY_ADDRESS
+#elif defined(NEXT)
+	#define DEFAULT_POLICY SF_POLICY_NEXT
+#else
+	#define DEFAULT_POLICY 0
+#endif
+
+/* SF_POLICY_AUTO looks at a heap every this many free list searches */
+#define AUTO_POLICY_INTERVAL 4096
+/* Fragmentation above which it orders the free list by address, and below which it goes back to LIFO */
+#define AUTO_FRAGMENTATION_HIGH 0.5
+#define AUTO_FRAGMENTATION_LOW 0.2
+/* Free regions looked at per search above which an address ordered list moves on to next fit, then to LIFO */
+#define AUTO_PROBES_HIGH 32
+
+/* A sample rate that costs little enough to leave on in production */
+#define SF_SAMPLE_DEFAULT_RATE (512 * 1024)
+
+/* Live samples the profiler can hold. A power of two */
+#define SAMPLE_TABLE_BITS 12
+#define SAMPLE_TABLE_SIZE (1 << SAMPLE_TABLE_BITS)
+
+/* Slot of a table of 1 << bits entries where the probe for ptr starts */
+#define POINTER_HASH(ptr, bits)	((size_t)((((uintptr_t)(ptr) >> 4) * 0x9E3779B97F4A7C15ULL) >> (64 - (bits))))
+
+/* Slot of the sample table where the probe for ptr starts */
+#define SAMPLE_HASH(ptr)	POINTER_HASH(ptr, SAMPLE_TABLE_BITS)
+
+/* Size of the table of live large objects when the first one is mapped, as a power of two. It doubles at half full. */
+#define LARGE_TABLE_BITS 10
+
+/* Deepest call stack a sample keeps */
+#define SAMPLE_MAX_DEPTH 32
 
 /**
- * Resizes the memory pointed to by ptr to be size bytes.
- * @param ptr Address of the memory region to resize.
- * @param size The minimum size to resize the memory to.
- * @return If successful, the pointer to a valid region
- * of memory to use is returned, else the value NULL is
- * returned and the ERRNO is set accordingly.
+ * A sampled live allocation, in the profiler's table keyed by address.
  */
-void* sf_realloc(void *ptr, size_t size);
-
-// /**
-//  * Allocate an array of nmemb elements each of size bytes.
-//  * The memory returned is additionally zeroed out.
-//  * @param nmemb Number of elements in the array.
-//  * @param size The size of bytes of each element.
-//  * @return If successful, returns the pointer to a valid
-//  * region of memory to use, else the value NULL is returned
-//  * and the ERRNO is set accordingly. If nmemb or
-//  * size is set to zero, then the value NULL is returned.
-//  */
-// void* sf_calloc(size_t nmemb, size_t size);
-
-// /**
-//  * Function which outputs the state of the free-list to stdout.
-//  * See sf_snapshot section for details on output format.
-//  */
-// void sf_snapshot(void);
+struct sf_sample
+{
+	void *ptr;			// the allocation. NULL for an unused entry.
+	size_t size;		// bytes requested
+	int64 stack_hash;	// so sf_profile_dump can group samples without comparing whole stacks
+	int depth;
+	bool dumped;		// already written out by the current sf_profile_dump
+	void *stack[SAMPLE_MAX_DEPTH];	// return addresses, innermost first
+};
 
 #endif
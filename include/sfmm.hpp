@@ -0,0 +1,273 @@
+/**
+ * C++ adapters for the allocator: an allocator for STL containers, a
+ * std::pmr::memory_resource, and optional replacements for the global
+ * operator new and delete.
+ *
+ * sfmm.c is C, so it is not included here. Compile it on its own, with the
+ * same -D flags (NEXT, ADDRESS, HUGEPAGE) as the C++ code, and link it in.
+ *
+ * To send every new and delete of the program to the allocator, define
+ * SF_REPLACE_OPERATOR_NEW before including this header in exactly one
+ * translation unit.
+ *
+ * Like the C API, none of this is thread safe.
+ */
+
+#ifndef __SFMM_HPP
+#define __SFMM_HPP
+
+extern "C"
+{
+	#include "sfmm_api.h"
+}
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#if __cplusplus >= 201703L
+	#include <memory_resource>
+#endif
+
+namespace sf
+{
+	/* Alignment every sf_malloc region already has. Anything stricter goes through sf_aligned_alloc */
+	constexpr std::size_t malloc_alignment = SF_ALIGNMENT;
+
+	namespace detail
+	{
+		/**
+		 * Set up the default heap on first use, which may be before main.
+		 */
+		inline void ensure_init()
+		{
+			static const bool initialized = (sf_mem_init(), true);
+			(void)initialized;
+		}
+
+		/**
+		 * Allocate size bytes with the given alignment. When both are known at
+		 * compile time, as they are for container nodes, the alignment test
+		 * folds away and this is a single call to sf_malloc.
+		 * @return The memory, or NULL if we ran out.
+		 */
+		inline void *allocate(std::size_t size, std::size_t alignment)
+		{
+			ensure_init();
+
+			// C++ allocations of 0 bytes must still return a unique pointer.
+			if (size == 0)
+				size = 1;
+
+			if (alignment <= malloc_alignment)
+				return sf_malloc(size);
+			return sf_aligned_alloc(alignment, size);
+		}
+
+		/**
+		 * Free memory from allocate. The caller always knows the size, so this
+		 * skips the heap walk sf_free would do.
+		 */
+		inline void deallocate(void *ptr, std::size_t size)
+		{
+			sf_free_sized(ptr, size == 0 ? 1 : size);
+		}
+	}
+
+	/**
+	 * Allocator for STL containers, such as std::map<K, V, std::less<K>, sf::allocator<std::pair<const K, V>>>.
+	 */
+	template <class T>
+	class allocator
+	{
+	public:
+		typedef T value_type;
+
+		allocator() noexcept {}
+
+		template <class U>
+		allocator(const allocator<U> &) noexcept {}
+
+		T *allocate(std::size_t n)
+		{
+			if (n > SIZE_MAX / sizeof(T))
+				throw std::bad_array_new_length();
+
+			void *ptr = detail::allocate(n * sizeof(T), alignof(T));
+			if (ptr == NULL)
+				throw std::bad_alloc();
+			return static_cast<T *>(ptr);
+		}
+
+		void deallocate(T *ptr, std::size_t n) noexcept
+		{
+			detail::deallocate(ptr, n * sizeof(T));
+		}
+	};
+
+	/* Every sf::allocator allocates from the same heap, so they all compare equal */
+	template <class T, class U>
+	bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+	{
+		return true;
+	}
+
+	template <class T, class U>
+	bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+	{
+		return false;
+	}
+
+#if __cplusplus >= 201703L
+
+	/**
+	 * Memory resource for std::pmr containers. Use get_memory_resource() for
+	 * the shared instance.
+	 */
+	class memory_resource : public std::pmr::memory_resource
+	{
+	protected:
+		void *do_allocate(std::size_t bytes, std::size_t alignment) override
+		{
+			void *ptr = detail::allocate(bytes, alignment);
+			if (ptr == NULL)
+				throw std::bad_alloc();
+			return ptr;
+		}
+
+		void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override
+		{
+			detail::deallocate(ptr, bytes);
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+		{
+			return dynamic_cast<const memory_resource *>(&other) != NULL;
+		}
+	};
+
+	inline memory_resource *get_memory_resource() noexcept
+	{
+		static memory_resource resource;
+		return &resource;
+	}
+
+#endif
+}
+
+#ifdef SF_REPLACE_OPERATOR_NEW
+
+/* Replacement functions may not be inline, hence the single translation unit */
+
+void *operator new(std::size_t size)
+{
+	void *ptr = sf::detail::allocate(size, sf::malloc_alignment);
+	if (ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	return sf::detail::allocate(size, sf::malloc_alignment);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	return sf::detail::allocate(size, sf::malloc_alignment);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+	sf::detail::deallocate(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+	sf::detail::deallocate(ptr, size);
+}
+
+#ifdef __cpp_aligned_new
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+	void *ptr = sf::detail::allocate(size, static_cast<std::size_t>(alignment));
+	if (ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return sf::detail::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return sf::detail::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	sf_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+	sf::detail::deallocate(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+	sf::detail::deallocate(ptr, size);
+}
+
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,476 @@
+/**
+ * The public interface of the allocator: its functions, and the types and
+ * constants they take. Unlike sfmm.h, which sfmm.c and the tools built on its
+ * internals include, this defines nothing outside the sf_ and SF_ prefixes, so
+ * it is safe to include anywhere, C++ included.
+ */
+
+#ifndef __SFMM_API_H
+#define __SFMM_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Alignment of every address sf_malloc returns. Anything stricter goes through sf_aligned_alloc */
+#define SF_ALIGNMENT 16
+
+/* Heaps and arenas are only handled through pointers */
+struct sf_heap;
+struct sf_arena;
+struct sf_arena_chunk;
+
+/* Tags sf_malloc_tagged accepts are 1 to SF_MAX_TAGS - 1. 0 is untagged. */
+#define SF_MAX_TAGS 64
+
+/**
+ * Accounting of one tag, in requested bytes.
+ */
+struct sf_tag_stats
+{
+	size_t live_bytes;			// bytes of live allocations with the tag
+	size_t peak_bytes;			// most live_bytes has ever been
+	size_t live_allocations;	// live allocations with the tag
+	size_t allocations;			// sf_malloc_tagged calls that succeeded, in total
+};
+
+/**
+ * Counters of a heap, filled in by sf_stats.
+ */
+struct sf_stats
+{
+	size_t heap_size;			// bytes of the heap
+	size_t requested_bytes;		// bytes asked for by live heap regions
+	size_t allocated_bytes;		// bytes of live heap regions, including headers, footers and padding
+	size_t free_bytes;			// bytes of free regions
+	size_t fast_bin_bytes;		// bytes freed to the fast bins, which are not in free_bytes until consolidated
+	size_t pending_bytes;		// bytes freed under -DDEFERRED, which are not in free_bytes until swept
+	size_t free_regions;		// number of free regions
+	size_t largest_free_region;	// size of the largest free region
+	double fragmentation;		// external fragmentation: 1 - largest_free_region / free_bytes
+	size_t large_bytes;			// bytes mapped for large objects
+	size_t extend_calls;		// times the heap grew
+	size_t extend_bytes;		// bytes the heap grew by, in total
+	size_t coalesce_cases[4];	// frees by coalesce case: no free neighbour, next free, previous free, both free
+	size_t find_fit_calls;		// free list searches
+	double find_fit_probes;		// free regions looked at per search, on average
+	int policy;					// SF_POLICY_* flags the heap runs with now
+	size_t policy_switches;		// times the policy changed, by sf_mallopt or SF_POLICY_AUTO
+};
+
+/* sf_heap_dump file format: one sf_dump_header, then one sf_dump_record per region in address order */
+#define SF_DUMP_MAGIC	0x504d4453	// "SDMP"
+#define SF_DUMP_VERSION	1
+
+struct sf_dump_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t heap_start;	// address of the heap when it was dumped
+	uint64_t heap_size;
+	uint64_t large_bytes;	// large objects are not in the region map, only counted here
+};
+
+struct sf_dump_record
+{
+	uint64_t offset;	// of the region header from heap_start
+	uint64_t header;	// the region's header word. Read it with GET_REGION_SIZE, GET_REQUESTED_SIZE and GET_ALLOC from sfmm.h.
+};
+
+/* sf_trace_start file format: one sf_trace_header, then sf_trace_events in no particular order. Sort them by seq. */
+#define SF_TRACE_MAGIC		0x43525453	// "STRC"
+#define SF_TRACE_VERSION	1
+
+/* sf_trace_event ops */
+#define SF_TRACE_MALLOC		1
+#define SF_TRACE_CALLOC		2	// arg is nmemb, size the size of each element
+#define SF_TRACE_REALLOC	3	// arg is the pointer passed in
+#define SF_TRACE_FREE		4	// size is the requested size of the region freed
+#define SF_TRACE_ALIGNED	5	// arg is the alignment
+
+struct sf_trace_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t event_size;	// sizeof(struct sf_trace_event)
+	uint32_t pad;
+};
+
+struct sf_trace_event
+{
+	uint64_t seq;		// order of the event among all threads. A gap means events were dropped.
+	uint64_t time;		// CLOCK_MONOTONIC nanoseconds
+	uint64_t ptr;		// pointer returned, or freed. 0 if an allocation failed.
+	uint64_t arg;		// depends on op
+	uint64_t size;		// bytes requested
+	uint32_t thread;	// kernel thread id
+	uint32_t op;		// SF_TRACE_*
+};
+
+/**
+ * A relocatable allocation from sf_halloc. 0 is never a valid handle.
+ */
+typedef size_t sf_handle;
+
+/* sf_compact flags */
+#define SF_COMPACT_TRIM	0x1	// give the free space gathered at the top of the heap back to the system
+
+/* sf_reserve flags */
+#define SF_RESERVE_PREFAULT	0x1	// fault in every page of the reservation up front
+#define SF_RESERVE_PARALLEL	0x2	// prefault with one thread per online CPU
+
+/**
+ * Called when the heap is about to grow past the soft limit, and again before
+ * a request is refused for crossing the hard limit.
+ * @param footprint Bytes the allocator would be using after the growth.
+ * @param arg The argument given to sf_register_pressure_callback.
+ */
+typedef void (*sf_pressure_callback)(size_t footprint, void *arg);
+
+/**
+ * A position in an arena, to roll back to with sf_arena_release.
+ */
+struct sf_arena_position
+{
+	struct sf_arena_chunk *chunk;
+	char *top;
+};
+
+/* sf_mallopt parameters */
+#define SF_LARGE_THRESHOLD	1	// requests of at least this many bytes bypass the heap
+#define SF_SAMPLE_RATE		2	// mean bytes allocated between heap profile samples. 0 turns sampling off.
+#define SF_POLICY			3	// free list policy of every heap, SF_POLICY_* flags
+#define SF_SIZE_CLASSES		4	// 1 rounds heap requests up to the table in sfmm_classes.h, 0 to 16 bytes
+#define SF_FAST_BINS		5	// requests up to this many bytes, at most 256, are freed to fast bins. 0 turns them off.
+
+/* Free list policies. LIFO first fit is 0 */
+#define SF_POLICY_ADDRESS	0x1	// keep the free list in address order
+#define SF_POLICY_NEXT		0x2	// next fit: start each search where the last one stopped
+#define SF_POLICY_AUTO		0x4	// let each heap switch ADDRESS and NEXT itself as it runs
+#define SF_POLICY_BEST		0x8	// best fit: take the smallest region that fits. Not with NEXT.
+#define SF_POLICY_MASK		(SF_POLICY_ADDRESS | SF_POLICY_NEXT | SF_POLICY_AUTO | SF_POLICY_BEST)
+
+/**
+ * This routine will initialize your memory allocator. It is called the
+ * `_start` function which is called before main is called.
+ * Calling it again does nothing.
+ */
+void sf_mem_init(void);
+
+/**
+ * This is your implementation of malloc. It creates dynamic memory which
+ * is aligned and padded properly for the underlying system. This memory
+ * is uninitialized.
+ * @param size The number of bytes requested to be allocated.
+ * @return If successful, the pointer to a valid region of memory
+ * to use is returned, else the value NULL is returned and the
+ * ERRNO is set accordingly. If size is set to zero, then the
+ * value NULL is returned.
+ */
+void* sf_malloc(size_t size);
+
+/** Marks a dynamically allocated region as no longer in use.
+ * @param ptr Address of memory returned by the function sf_malloc,
+ * sf_realloc, or sf_calloc.
+ */
+void sf_free(void *ptr);
+
+/**
+ * Like sf_free, for callers that know the size they asked for. The pointer is
+ * trusted instead of looked up by walking the heap. Debug builds still validate
+ * it and refuse to free when size does not match the header.
+ * @param ptr Address of memory returned by the allocator.
+ * @param size The size originally requested for ptr.
+ */
+void sf_free_sized(void *ptr, size_t size);
+
+/**
+ * Allocate n objects with one search of the free list and at most one heap
+ * extension, laid out next to each other. Each can still be given to sf_free
+ * on its own.
+ * @param n Number of objects.
+ * @param sizes Size in bytes of each object. Objects of size 0 get NULL.
+ * @param ptrs Filled in with the address of each object.
+ * @return ptrs if successful, else NULL with ERRNO set and nothing allocated.
+ */
+void** sf_comalloc(size_t n, const size_t sizes[], void *ptrs[]);
+
+/**
+ * Free n regions in one pass. Regions that are next to each other in the heap
+ * are merged with a single coalesce.
+ * @param ptrs Addresses to free. The array is sorted by address in place.
+ * NULL entries are skipped.
+ * @param n Number of addresses.
+ */
+void sf_free_batch(void **ptrs, size_t n);
+
+/**
+ * Resizes the memory pointed to by ptr to be size bytes.
+ * @param ptr Address of the memory region to resize.
+ * @param size The minimum size to resize the memory to.
+ * @return If successful, the pointer to a valid region
+ * of memory to use is returned, else the value NULL is
+ * returned and the ERRNO is set accordingly.
+ */
+void* sf_realloc(void *ptr, size_t size);
+
+/**
+ * The number of bytes the caller may use at ptr. This is at least the size
+ * that was asked for; the rest is padding the allocator had to add anyway.
+ * Growing ptr with sf_realloc up to this size never moves it.
+ * @param ptr Address of memory returned by the allocator.
+ * @return The usable size, or 0 if ptr is not an allocated region.
+ */
+size_t sf_malloc_usable_size(void *ptr);
+
+/**
+ * Allocate size bytes whose address is a multiple of alignment. The memory
+ * can be given to sf_free and sf_realloc like any other.
+ * @param alignment A power of two.
+ * @param size The number of bytes requested to be allocated.
+ * @return The aligned memory, or NULL with ERRNO set to EINVAL if alignment is
+ * not a power of two or to ENOMEM if we ran out of memory.
+ */
+void* sf_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * posix_memalign on top of sf_aligned_alloc.
+ * @param memptr Where to store the aligned memory.
+ * @param alignment A power of two multiple of sizeof(void *).
+ * @param size The number of bytes requested to be allocated.
+ * @return 0 on success, EINVAL for a bad alignment or ENOMEM.
+ */
+int sf_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * Change a tunable of the allocator. SF_POLICY applies to every heap, and
+ * switching to SF_POLICY_ADDRESS sorts each free list once. Changing
+ * SF_FAST_BINS empties the fast bins of every heap into its free list.
+ * @param param One of the SF_* parameters.
+ * @param value The new value for it.
+ * @return 1 on success, 0 if param is unknown or value is out of range.
+ */
+int sf_mallopt(int param, size_t value);
+
+/**
+ * Grow the heap ahead of time so at least bytes are free in one region at the
+ * top of the heap. Reserved memory is never trimmed, so later mallocs that fit
+ * in it make no syscalls.
+ * @param bytes How many bytes should be free at the top of the heap.
+ * @param flags SF_RESERVE_PREFAULT to also fault the pages in, and
+ * SF_RESERVE_PARALLEL to do that with several threads.
+ * @return How long the reservation took in nanoseconds, or -1 with
+ * ERRNO set if the heap could not grow.
+ */
+long sf_reserve(size_t bytes, int flags);
+
+/**
+ * Limit the memory the allocator may use: the heap plus all large objects.
+ * @param soft Growing past this fires the pressure callbacks. 0 for none.
+ * @param hard Growing past this fails with ENOMEM, after the pressure callbacks
+ * have run and the heap has been trimmed. 0 for none.
+ * @return 0 on success, -1 with ERRNO set to EINVAL if soft is above hard.
+ */
+int sf_set_limit(size_t soft, size_t hard);
+
+/**
+ * Register a callback for memory pressure. Callbacks may call sf_free to drop
+ * their own caches.
+ * @return 0 on success, -1 with ERRNO set to ENOMEM if the table is full.
+ */
+int sf_register_pressure_callback(sf_pressure_callback callback, void *arg);
+
+/**
+ * Remove a callback added with sf_register_pressure_callback.
+ * @return 0 on success, -1 with ERRNO set to EINVAL if it was not registered.
+ */
+int sf_unregister_pressure_callback(sf_pressure_callback callback, void *arg);
+
+/**
+ * Create a bump pointer arena. Its memory comes from the heap and goes back
+ * with sf_arena_destroy; individual objects are never freed.
+ * @param initial Bytes to set aside up front, or 0 for a default.
+ * @return The arena, or NULL with ERRNO set to ENOMEM.
+ */
+struct sf_arena* sf_arena_create(size_t initial);
+
+/**
+ * Allocate size bytes from an arena, aligned like sf_malloc. Chains in a new
+ * chunk when the current one is full.
+ * @return The memory, or NULL with ERRNO set. NULL for a size of 0.
+ */
+void* sf_arena_alloc(struct sf_arena *arena, size_t size);
+
+/**
+ * Remember the current position of an arena.
+ */
+struct sf_arena_position sf_arena_mark(struct sf_arena *arena);
+
+/**
+ * Roll an arena back to a position from sf_arena_mark, dropping everything
+ * allocated since. Chunks chained in after the mark go back to the heap.
+ */
+void sf_arena_release(struct sf_arena *arena, struct sf_arena_position mark);
+
+/**
+ * Drop everything allocated from an arena, keeping only its first chunk.
+ */
+void sf_arena_reset(struct sf_arena *arena);
+
+/**
+ * Give every chunk of an arena back to the heap. The arena can no longer be used.
+ */
+void sf_arena_destroy(struct sf_arena *arena);
+
+/**
+ * Create a heap of its own, independent of the default heap that sf_malloc
+ * uses and of every other heap. It grows inside an address range reserved
+ * up front, and all of its memory goes away at once with sf_heap_destroy.
+ * @param max_size Most bytes the heap may grow to, or 0 for HEAP_DEFAULT_RESERVE.
+ * Large objects do not count against it.
+ * @return The heap, or NULL with ERRNO set to ENOMEM.
+ */
+struct sf_heap* sf_heap_create(size_t max_size);
+
+/**
+ * sf_malloc on the given heap.
+ */
+void* sf_heap_malloc(struct sf_heap *heap, size_t size);
+
+/**
+ * sf_free on the given heap. ptr must have come from the same heap; one from
+ * another heap is left alone.
+ */
+void sf_heap_free(struct sf_heap *heap, void *ptr);
+
+/**
+ * sf_realloc on the given heap. ptr must have come from the same heap; one
+ * from another heap is left alone, as if ptr were NULL.
+ */
+void* sf_heap_realloc(struct sf_heap *heap, void *ptr, size_t size);
+
+/**
+ * Release a heap and everything allocated from it, without looking at the
+ * individual allocations. The default heap cannot be destroyed.
+ */
+void sf_heap_destroy(struct sf_heap *heap);
+
+/**
+ * Allocate size bytes that sf_compact may move. Pin the handle to get the
+ * current address; while pinned the memory stays where it is.
+ * @return The handle, or 0 with ERRNO set. 0 for a size of 0.
+ */
+sf_handle sf_halloc(size_t size);
+
+/**
+ * Pin a handle and get the current address of its memory. Pins nest.
+ * @return The address, or NULL if handle is not a live handle.
+ */
+void* sf_hpin(sf_handle handle);
+
+/**
+ * Undo one sf_hpin. Once every pin is undone, addresses from sf_hpin must
+ * not be used anymore.
+ */
+void sf_hunpin(sf_handle handle);
+
+/**
+ * Free the memory of a handle, pinned or not, and the handle itself.
+ */
+void sf_hfree(sf_handle handle);
+
+/**
+ * Slide every unpinned handle allocation toward the start of the heap, so the
+ * free space between them joins into as few regions as possible. Regions from
+ * sf_malloc and pinned handles stay where they are.
+ * @param flags SF_COMPACT_TRIM to release the free space left at the top of
+ * the heap, even below a reservation from sf_reserve.
+ * @return The number of bytes moved.
+ */
+size_t sf_compact(int flags);
+
+/**
+ * sf_malloc, with the allocation counted against tag until it is freed.
+ * sf_realloc keeps the tag. Tags cost nothing to look up: a tagged region
+ * has a bit set in its header, and the tag is in its footer.
+ * @param tag 1 to SF_MAX_TAGS - 1, for example one per subsystem.
+ * @return The memory, or NULL with ERRNO set to ENOMEM, or to EINVAL for a
+ * bad tag.
+ */
+void* sf_malloc_tagged(size_t size, int tag);
+
+/**
+ * Read the accounting of a tag on the default heap.
+ * @return 0, or -1 with ERRNO set to EINVAL for a bad tag.
+ */
+int sf_tag_stats(int tag, struct sf_tag_stats *out);
+
+/**
+ * sf_tag_stats for the given heap.
+ */
+int sf_heap_tag_stats(struct sf_heap *heap, int tag, struct sf_tag_stats *out);
+
+/**
+ * Write the region map of the default heap to fd in the sf_dump format, in
+ * one pass over the heap and without allocating. Analyze it with ./analyze.
+ * @return 0 on success, or -1 with ERRNO set if a write failed.
+ */
+int sf_heap_dump(int fd);
+
+/**
+ * Write the live sampled allocations, grouped by call stack, to fd as a
+ * pprof legacy heap profile (heap_v2), followed by the memory map pprof needs
+ * to symbolize it: pprof <program> <file>. Turn sampling on first with
+ * sf_mallopt(SF_SAMPLE_RATE, SF_SAMPLE_DEFAULT_RATE). Nothing is allocated.
+ * @return 0 on success, or -1 with ERRNO set if a write failed.
+ */
+int sf_profile_dump(int fd);
+
+/**
+ * Start recording every sf_malloc, sf_calloc, sf_realloc, sf_aligned_alloc and
+ * free on the default heap. Each thread appends to its own ring without
+ * locking, and a flusher thread writes the rings to fd in the sf_trace format.
+ * Replay the file with ./replay, built with any policy.
+ * @return 0, or -1 with ERRNO set to EBUSY if already tracing, or to why the
+ * header could not be written or the flusher not started.
+ */
+int sf_trace_start(int fd);
+
+/**
+ * Stop tracing and flush what is left.
+ * @return The number of events dropped because a ring was full, or -1 with
+ * ERRNO set if a write failed or nothing was being traced.
+ */
+long sf_trace_stop(void);
+
+/**
+ * Read the counters of the default heap. They are kept as the heap changes,
+ * so polling is O(1). Only after the largest free region left the free list
+ * does the next call walk the list once to find the new one.
+ * @param out Filled in with the counters.
+ */
+void sf_stats(struct sf_stats *out);
+
+/**
+ * sf_stats for the given heap.
+ */
+void sf_heap_stats(struct sf_heap *heap, struct sf_stats *out);
+
+// /**
+//  * Allocate an array of nmemb elements each of size bytes.
+//  * The memory returned is additionally zeroed out.
+//  * @param nmemb Number of elements in the array.
+//  * @param size The size of bytes of each element.
+//  * @return If successful, returns the pointer to a valid
+//  * region of memory to use, else the value NULL is returned
+//  * and the ERRNO is set accordingly. If nmemb or
+//  * size is set to zero, then the value NULL is returned.
+//  */
+// void* sf_calloc(size_t nmemb, size_t size);
+
+// /**
+//  * Function which outputs the state of the free-list to stdout.
+//  * See sf_snapshot section for details on output format.
+//  */
+// void sf_snapshot(void);
+
+#endif
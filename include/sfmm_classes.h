@@ -0,0 +1,25 @@
+/**
+ * Size classes: region sizes, header and footer included, that heap
+ * requests are rounded up to when SF_SIZE_CLASSES is on. Generated with:
+ *
+ * ./classes 47 bench_classes.out
+ *
+ * Fitted to 1000000 allocations, it wastes 28807694 bytes on them.
+ */
+
+#ifndef __SFMM_CLASSES_H
+#define __SFMM_CLASSES_H
+
+#define SIZE_CLASS_COUNT 47
+
+static const int32 size_classes[SIZE_CLASS_COUNT] =
+{
+	48, 64, 80, 96, 112, 128, 144, 160,
+	256, 368, 464, 560, 656, 752, 848, 944,
+	1040, 1136, 1248, 1360, 1472, 1584, 1696, 1792,
+	1904, 2000, 2096, 2192, 2288, 2400, 2512, 2624,
+	2720, 2816, 2912, 3024, 3136, 3248, 3344, 3440,
+	3536, 3632, 3728, 3824, 3920, 4016, 4128,
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "sfmm.c"
+
+/**
+ * Shared library that replaces the C library's malloc family with the
+ * allocator, so unmodified programs can run on it:
+ *
+ * make preload
+ * LD_PRELOAD=./libsfmm.so <program>
+ *
+ * The allocator is single threaded, so every call holds one lock. The libc
+ * malloc is never called, which leaves nothing to look up with dlsym and so
+ * no recursion through it. Build without DEBUG: the traces call printf,
+ * which allocates.
+ *
+ * SFMM_TRACE=<file> records every call with sf_trace_start, for ./replay.
+ * Only that process is traced: the variable is taken out of the environment
+ * so programs it runs do not overwrite the file, and forked children stop
+ * tracing.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool initialized = false;
+
+/**
+ * Take the lock and make sure the default heap is set up. The first
+ * allocation can come from the dynamic linker, long before main.
+ */
+static void enter()
+{
+	pthread_mutex_lock(&lock);
+	if (!initialized)
+	{
+		sf_mem_init();
+		initialized = true;
+	}
+}
+
+static void leave()
+{
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Whether ptr is a live region of the default heap or a large object. Unlike
+ * sf_free this does not walk the heap, which would make every free O(n) in a
+ * real program. Pointers we did not hand out, like the ones from the dynamic
+ * linker's own allocator, fail this check and are left alone.
+ * @param is_large Set to whether ptr is a large object.
+ */
+static bool owned(void *ptr, bool *is_large)
+{
+	*is_large = false;
+	if ((int64*)ptr > heap->prologue_footer && (int64*)ptr < heap->epilogue_header)
+		return ((uintptr_t)ptr & (DSIZE - 1)) == 0 && GET_ALLOC(HEADER_ADDRESS(ptr)) == ALLOCATED;
+
+	*is_large = is_large_ptr(ptr);
+	return *is_large;
+}
+
+/**
+ * The lock is held across fork so the child gets a heap nobody is in the
+ * middle of changing. The child has only the forking thread, so it can
+ * start over with a fresh lock.
+ */
+static void prepare_fork()
+{
+	pthread_mutex_lock(&lock);
+}
+
+static void parent_after_fork()
+{
+	pthread_mutex_unlock(&lock);
+}
+
+static void child_after_fork()
+{
+	pthread_mutex_init(&lock, NULL);
+
+	// The flusher thread was not copied, so nothing would empty the rings.
+	__atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor))
+static void install_fork_handlers()
+{
+	pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+}
+
+static void stop_trace()
+{
+	sf_trace_stop();
+}
+
+/**
+ * Trace the whole run of the program if SFMM_TRACE names a file.
+ */
+__attribute__((constructor))
+static void start_trace()
+{
+	const char *path = getenv("SFMM_TRACE");
+	if (path == NULL || *path == '\0')
+		return;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	unsetenv("SFMM_TRACE");
+	if (fd < 0)
+		return;
+
+	if (sf_trace_start(fd) == 0)
+		atexit(stop_trace);
+	else
+		close(fd);
+}
+
+/* The sf_* functions clear errno on success, the C library must not */
+
+void *malloc(size_t size)
+{
+	int saved_errno = errno;
+	enter();
+	void *ptr = sf_malloc(size == 0 ? 1 : size);
+	leave();
+	if (ptr != NULL)
+		errno = saved_errno;
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	enter();
+	bool is_large;
+	if (owned(ptr, &is_large))
+	{
+		trace(SF_TRACE_FREE, ptr, 0, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+		if (is_large)
+			free_large(ptr);
+		else
+			free_region(ptr);
+	}
+	leave();
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (nmemb == 0 || size == 0)
+		nmemb = size = 1;
+
+	int saved_errno = errno;
+	enter();
+	void *ptr = sf_calloc(nmemb, size);
+	leave();
+	if (ptr != NULL)
+		errno = saved_errno;
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return malloc(size);
+
+	if (size == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+	if (size > FOUR_GB)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	int saved_errno = errno;
+	enter();
+	bool is_large;
+	void *new_ptr = NULL;
+	if (owned(ptr, &is_large))
+	{
+		new_ptr = reallocate(ptr, size, is_large);
+		trace(SF_TRACE_REALLOC, new_ptr, (int64)ptr, size);
+	}
+	else
+		errno = ENOMEM;
+	leave();
+	if (new_ptr != NULL)
+		errno = saved_errno;
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, total);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	int saved_errno = errno;
+	enter();
+	int ret = sf_posix_memalign(memptr, alignment, size == 0 ? 1 : size);
+	leave();
+	errno = saved_errno;
+	return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	int saved_errno = errno;
+	enter();
+	void *ptr = sf_aligned_alloc(alignment, size == 0 ? 1 : size);
+	leave();
+	if (ptr != NULL)
+		errno = saved_errno;
+	return ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return aligned_alloc(FOUR_KB, size);
+}
+
+void *pvalloc(size_t size)
+{
+	return aligned_alloc(FOUR_KB, ALIGN_UP(size == 0 ? 1 : size, FOUR_KB));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	if (ptr == NULL)
+		return 0;
+
+	enter();
+	bool is_large;
+	size_t size = owned(ptr, &is_large) ? usable_size(ptr, is_large) : 0;
+	leave();
+	return size;
+}
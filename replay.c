@@ -0,0 +1,243 @@
+#include "sfmm.c"
+
+#include <sys/stat.h>
+
+/**
+ * Replays a trace from sf_trace_start against the allocator, to reproduce the
+ * fragmentation of a real run offline. Build it with the policy to try:
+ *
+ * make replay POLICY="-DADDRESS -DNEXT"
+ * ./replay <trace>
+ *
+ * Frees are replayed with sf_free_sized. The trace knows every pointer is
+ * valid, and sf_free would spend the replay walking the heap.
+ */
+
+/* An event rewritten for the replay: pointers become slots */
+struct replay_event
+{
+	int64 slot;		// slot of the pointer returned or freed. 0 for none.
+	int64 old_slot;	// slot of sf_realloc's pointer. 0 for NULL or one the trace never saw.
+	int64 arg;
+	int64 size;
+	int32 op;
+};
+
+static struct sf_trace_event *load_trace(const char *path, size_t *count);
+static struct replay_event *assign_slots(struct sf_trace_event *events, size_t count, size_t *slots);
+static void *map_array(size_t count, size_t size);
+static int compare_seq(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	size_t count, slot_count = 0;
+	struct sf_trace_event *events = load_trace(argv[1], &count);
+	if (events == NULL)
+		return EXIT_FAILURE;
+
+	struct replay_event *replay = assign_slots(events, count, &slot_count);
+	void **slots = replay == NULL ? NULL : map_array(slot_count + 1, sizeof(void*));
+	if (replay == NULL || slots == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	sf_mem_init();
+
+	size_t peak_heap_size = 0;
+	size_t i;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+	{
+		struct replay_event *e = &replay[i];
+		switch (e->op)
+		{
+			case SF_TRACE_MALLOC:
+				slots[e->slot] = sf_malloc(e->size);
+				break;
+			case SF_TRACE_CALLOC:
+				slots[e->slot] = sf_calloc(e->arg, e->size);
+				break;
+			case SF_TRACE_ALIGNED:
+				slots[e->slot] = sf_aligned_alloc(e->arg, e->size);
+				break;
+			case SF_TRACE_REALLOC:
+				slots[e->slot] = sf_realloc(slots[e->old_slot], e->size);
+				break;
+			case SF_TRACE_FREE:
+				sf_free_sized(slots[e->slot], e->size);
+				slots[e->slot] = NULL;
+				break;
+		}
+
+		if (heap->heap_size > peak_heap_size)
+			peak_heap_size = heap->heap_size;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	struct sf_stats stats;
+	sf_stats(&stats);
+
+	printf("replay: %lu events in %.3fms (%.1fns per event)\n", count, elapsed * 1e3, count > 0 ? elapsed / count * 1e9 : 0.0);
+	printf("replay: heap=%lu peak=%lu large=%lu\n", stats.heap_size, peak_heap_size, stats.large_bytes);
+	printf("replay: requested=%lu allocated=%lu free=%lu in %lu regions, largest=%lu fragmentation=%.3f\n",
+		stats.requested_bytes, stats.allocated_bytes, stats.free_bytes, stats.free_regions,
+		stats.largest_free_region, stats.fragmentation);
+	if (stats.fast_bin_bytes != 0 || stats.pending_bytes != 0)
+		printf("replay: not yet coalesced: fast bins=%lu pending=%lu\n", stats.fast_bin_bytes, stats.pending_bytes);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Read a trace and put its events in the order they happened.
+ * @return The events, or NULL after printing why not.
+ */
+static struct sf_trace_event *load_trace(const char *path, size_t *count)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		perror(path);
+		return NULL;
+	}
+
+	struct sf_trace_header header;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != SF_TRACE_MAGIC)
+	{
+		fprintf(stderr, "%s: not a trace\n", path);
+		return NULL;
+	}
+
+	if (header.version != SF_TRACE_VERSION || header.event_size != sizeof(struct sf_trace_event))
+	{
+		fprintf(stderr, "%s: trace version %d, expected %d\n", path, header.version, SF_TRACE_VERSION);
+		return NULL;
+	}
+
+	*count = (st.st_size - sizeof(header)) / sizeof(struct sf_trace_event);
+	struct sf_trace_event *events = map_array(*count, sizeof(struct sf_trace_event));
+	if (events == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return NULL;
+	}
+
+	char* p = (char*)events;
+	size_t left = *count * sizeof(struct sf_trace_event);
+	while (left > 0)
+	{
+		ssize_t n = read(fd, p, left);
+		if (n <= 0)
+		{
+			perror(path);
+			return NULL;
+		}
+		p += n;
+		left -= n;
+	}
+	close(fd);
+
+	// Each thread's events were flushed in order, but the threads were not.
+	qsort(events, *count, sizeof(struct sf_trace_event), compare_seq);
+
+	int64 dropped = *count > 0 ? events[*count - 1].seq - events[0].seq + 1 - *count : 0;
+	if (dropped > 0)
+		fprintf(stderr, "%s: %lu events were dropped, the replay will differ\n", path, dropped);
+
+	return events;
+}
+
+/**
+ * Give every allocation in the trace its own slot, so the replay can find
+ * the pointer it got back for it without hashing. Frees of pointers the trace
+ * never saw allocated, like ones from before tracing started, free slot 0,
+ * which is always NULL.
+ * @param slots Set to the number of slots used.
+ */
+static struct replay_event *assign_slots(struct sf_trace_event *events, size_t count, size_t *slots)
+{
+	struct replay_event *replay = map_array(count, sizeof(struct replay_event));
+
+	// Address to slot of the latest allocation there. Reused addresses
+	// overwrite the entry, so nothing is ever deleted.
+	int bits = 6;
+	while (((size_t)1 << bits) < count * 2)
+		bits++;
+	size_t capacity = (size_t)1 << bits;
+	int64 *addresses = map_array(capacity, sizeof(int64));
+	int64 *address_slots = map_array(capacity, sizeof(int64));
+	if (replay == NULL || addresses == NULL || address_slots == NULL)
+		return NULL;
+
+	*slots = 0;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		struct sf_trace_event *e = &events[i];
+		struct replay_event *r = &replay[i];
+		r->op = e->op;
+		r->arg = e->arg;
+		r->size = e->size;
+
+		// A realloc frees its old pointer. Look it up like a free.
+		int64 lookup = e->op == SF_TRACE_REALLOC ? e->arg : e->op == SF_TRACE_FREE ? e->ptr : 0;
+		if (lookup != 0)
+		{
+			size_t h = POINTER_HASH(lookup, bits);
+			while (addresses[h] != 0 && addresses[h] != lookup)
+				h = (h + 1) & (capacity - 1);
+			int64 slot = addresses[h] == lookup ? address_slots[h] : 0;
+
+			if (e->op == SF_TRACE_FREE)
+				r->slot = slot;
+			else
+				r->old_slot = slot;
+		}
+
+		if (e->op != SF_TRACE_FREE)
+		{
+			// A failed allocation gets a slot too, so the replay does the same calls.
+			r->slot = ++*slots;
+			if (e->ptr != 0)
+			{
+				size_t h = POINTER_HASH(e->ptr, bits);
+				while (addresses[h] != 0 && addresses[h] != e->ptr)
+					h = (h + 1) & (capacity - 1);
+				addresses[h] = e->ptr;
+				address_slots[h] = r->slot;
+			}
+		}
+	}
+
+	munmap(addresses, capacity * sizeof(int64));
+	munmap(address_slots, capacity * sizeof(int64));
+	return replay;
+}
+
+/**
+ * Zeroed memory for count elements, straight from mmap so the replay's own
+ * bookkeeping stays out of the heap being measured.
+ */
+static void *map_array(size_t count, size_t size)
+{
+	void *p = mmap(NULL, count * size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+	int64 x = ((const struct sf_trace_event *)a)->seq, y = ((const struct sf_trace_event *)b)->seq;
+	return (x > y) - (x < y);
+}
@@ -1,19 +1,48 @@
 #include "include/sfmm.h"
+#include "include/sfmm_classes.h"
 
-static int64 *prologue_header;
-static int64 *prologue_footer;
-static int64 *epilogue_header;
+static struct sf_heap default_heap;	// the heap sf_malloc and friends work on. Grows with sbrk.
+static struct sf_heap *heap = &default_heap;	// the heap every function below works on
 
-static int64 *heap_start;	// always points to the start of the heap
-static size_t heap_size = 0;	// size of the heap
+static char *placed_dirty_end = NULL;	// the payload place() handed out last may be dirty up to here, not counting its first two words
 
-static int64 *freelist_pointer;	// pointer to head of start of explicit freelist
-								// if ADDRESS is set to true, this always points to the first
-								// free region in address order.
+static size_t soft_limit = 0;	// heap + large objects may not grow past these. 0 is no limit.
+static size_t hard_limit = 0;
 
-#ifdef NEXT
-	static int64 *next_free_pointer; // pointer that points to the free region after the one we just allocated
-#endif
+static struct
+{
+	sf_pressure_callback callback;
+	void *arg;
+} pressure_callbacks[MAX_PRESSURE_CALLBACKS];
+static int num_pressure_callbacks = 0;
+static bool in_pressure_callback = false;	// callbacks that allocate must not set off more callbacks
+
+static size_t large_threshold = LARGE_THRESHOLD;	// requests this big skip the heap
+static int default_policy = DEFAULT_POLICY;	// policy of heaps set up from now on
+static bool use_size_classes = false;	// round heap requests up to size_classes
+static size_t fast_bin_size = 0;	// largest region size freed to a fast bin. 0 is off.
+
+static struct sf_handle_entry *handle_table = NULL;	// mapped on the first sf_halloc. Entry 0 is never used.
+static size_t handle_capacity = 0;
+static sf_handle free_handles = 0;	// first unused entry, chained through pins. 0 when there are none.
+
+static char **large_table = NULL;	// payloads of the live large objects of every heap, open addressed
+static size_t large_table_bits = 0;
+static size_t large_count = 0;
+
+static size_t sample_rate = 0;	// mean bytes between heap profile samples. 0 is off.
+static size_t bytes_until_sample = SIZE_MAX;	// counts down as memory is handed out. A sample is taken when it runs out.
+static int64 sample_seed = 0;
+static struct sf_sample *sample_table = NULL;	// mapped when sampling is first turned on
+static size_t sample_count = 0;	// live samples in the table
+
+static bool tracing = false;	// between sf_trace_start and sf_trace_stop
+static int trace_fd = -1;
+static bool trace_failed = false;	// a write to trace_fd failed
+static int64 trace_seq = 0;	// next sequence number, shared by every thread
+static struct sf_trace_ring *trace_rings = NULL;	// rings of every thread that ever traced. They are never unmapped.
+static __thread struct sf_trace_ring *thread_ring __attribute__((tls_model("initial-exec"))) = NULL;
+static pthread_t trace_flusher;
 
 
 /* private function declarations */
@@ -22,44 +51,130 @@ void print_all_regions();
 void print_region_stats(void *ptr);
 static void *extend_heap(size_t size);
 static void *find_fit(size_t size);
-static void *find_fit_recursive(void *fp, size_t size);
+static inline void *search_free_list(int64 *start_ptr, size_t size, int placement) __attribute__((always_inline));
 static void place(void *ptr, size_t adjusted_size, size_t requested_size);
 static void *coalesce(void *ptr);
+static void clear_boundary(void *hp);
+static void clear_tags_above_floor(void *hp);
+static void zero_payload(void *ptr, size_t size);
 static bool is_valid_heap_ptr(void *ptr_to_free);
 static void *allocate(size_t size);
-#ifdef ADDRESS
-	static void convert_to_address_policy();
+static void *find_or_extend(size_t adjusted_size);
+static size_t class_size(size_t adjusted_size);
+static int compare_addresses(const void *a, const void *b);
+static void free_region(void *ptr);
+static bool is_pending(void *hp);
+#ifdef DEFERRED
+	static void sweep_pending();
 #endif
+static void *pop_fast_bin(size_t adjusted_size, size_t requested_size);
+static void consolidate_fast_bins();
+static void coalesce_deferred_frees();
+static void *reallocate(void *ptr, size_t size, bool is_large);
+static void *resize(void *ptr, size_t size, bool is_large);
+static void *allocate_large(size_t size, size_t alignment);
+static void *allocate_aligned(size_t alignment, size_t size);
+static void *find_fit_aligned(size_t size, size_t alignment);
+static void *aligned_payload(void *hp, size_t size, size_t alignment);
+static void place_aligned(void *hp, void *ptr, size_t adjusted_size, size_t requested_size);
+static void free_large(void *ptr);
+static void *realloc_large(void *ptr, size_t size);
+static size_t usable_size(void *ptr, bool is_large);
+static struct sf_arena_chunk *arena_chunk(struct sf_arena_chunk *prev, size_t size);
+static void free_arena_chunk(struct sf_arena_chunk *chunk);
+static sf_handle new_handle();
+static bool is_live_handle(sf_handle handle);
+static bool is_handle_region(void *rp);
+static void free_gap(char *start, char *end);
+static int write_all(int fd, const void *buf, size_t size);
+static void *sample_allocation(void *ptr, size_t size);
+static void record_sample(void *ptr, size_t size);
+static void drop_sample(void *ptr);
+static void drop_sample_at(size_t i);
+static void drop_samples_of_heap(struct sf_heap *h);
+static size_t next_sample_interval();
+static double fast_log2(double x);
+static void tag_region(void *ptr, size_t tag);
+static void untag_region(void *ptr);
+static size_t get_tag(void *ptr);
+static void trace(int op, void *ptr, int64 arg, size_t size);
+static struct sf_trace_ring *trace_ring();
+static void flush_trace();
+static void *trace_flusher_main(void *arg);
+static void set_requested_size(void *ptr, size_t size);
+static bool is_large_ptr(void *ptr);
+static bool add_large(char *payload);
+static void remove_large(char *payload);
+static bool grow_large_table();
+static void freelist_insert(void *hp);
+static void freelist_remove(void *hp);
+static void freelist_replace(void *old_hp, void *new_hp);
+static void freelist_insert_after(void *prev_hp, void *hp);
+static void largest_free_added(size_t size);
+static void largest_free_removed(size_t size);
+static void trim_heap(bool under_pressure);
+static bool within_limits(size_t inc);
+static size_t footprint();
+static void init_heap();
+static void *heap_sbrk(intptr_t inc);
+static void fire_pressure_callbacks(size_t footprint);
+static void relieve_pressure();
+static void prefault(char *start, char *end, bool parallel);
+static void *prefault_worker(void *arg);
+#ifdef HUGEPAGE
+	static void *find_fit_in_touched_pages(size_t size);
+#endif
+static void convert_to_address_policy();
+static void set_policy(int policy);
+static void tune_policy();
+static size_t free_list_bytes();
 void sf_mem_init()
 {
 	#ifdef DEBUG
 		printf("Initialize memory management\n");
 	#endif
 
+	// Code that allocates before main, like C++ static constructors, may have
+	// set the default heap up already.
+	heap = &default_heap;
+	if (heap->heap_start == NULL)
+		init_heap();
+}
+
+/**
+ * Lay out an empty heap with prologue and epilogue at the break of the current heap.
+ */
+static void init_heap()
+{
 	// Create the intial empty heap with enough space for front padding, prologue and epilogue blocks.
-	heap_size += MIN_REGION_SIZE;
-	heap_start = (int64 *)sbrk(heap_size);
+	heap->heap_size += MIN_REGION_SIZE;
+	heap->heap_start = (int64 *)heap_sbrk(heap->heap_size);
 	
 
 	// Alignment padding set to 0x0
-	PUT(heap_start, 0);								
+	PUT(heap->heap_start, 0);								
 
 	// Set prologue header. This never changes.
-	prologue_header = (int64*)NEXT_WORD(heap_start);
-	PUT(prologue_header, PACK(0, DSIZE, ALLOCATED));
+	heap->prologue_header = (int64*)NEXT_WORD(heap->heap_start);
+	PUT(heap->prologue_header, PACK(0, DSIZE, ALLOCATED));
 
 	// Set prologue footer. This never changes.
-	prologue_footer = (int64*)NEXT_WORD(prologue_header);
-	PUT(prologue_footer, PACK(0, DSIZE, ALLOCATED));
+	heap->prologue_footer = (int64*)NEXT_WORD(heap->prologue_header);
+	PUT(heap->prologue_footer, PACK(0, DSIZE, ALLOCATED));
 
 	// Set epilogue header
-	epilogue_header = (int64*)NEXT_WORD(prologue_footer);
-	PUT(epilogue_header, PACK(0, 0, ALLOCATED));
-
-	freelist_pointer = epilogue_header;
-	
-	#ifdef NEXT
-		next_free_pointer = freelist_pointer;
+	heap->epilogue_header = (int64*)NEXT_WORD(heap->prologue_footer);
+	PUT(heap->epilogue_header, PACK(0, 0, ALLOCATED));
+	heap->zero_floor = (char*)heap->epilogue_header;
+
+	heap->freelist_pointer = NULL;
+	heap->next_free_pointer = NULL;
+	heap->largest_free = 0;
+	heap->largest_free_dirty = false;
+	heap->policy = default_policy;
+
+	#ifdef HUGEPAGE
+		heap->touched_top = (char*)NEXT_WORD(heap->epilogue_header);
 	#endif
 
 	#ifdef DEBUG
@@ -86,31 +201,90 @@ void* sf_malloc(size_t size)
 		return NULL;
 	}
 
-	return allocate(size);
+	void* ptr = sample_allocation(allocate(size), size);
+	trace(SF_TRACE_MALLOC, ptr, 0, size);
+	return ptr;
 }
 
 static void* allocate(size_t size)
 {
+	if (size >= large_threshold)
+		return allocate_large(size, DSIZE);
 
 	size_t adjusted_size = REGION_SIZE(size);
+	if (use_size_classes)
+		adjusted_size = class_size(adjusted_size);
 	#ifdef DEBUG
 		printf(" - adjusted to: %lu\n", adjusted_size);
 	#endif
 
+	if (adjusted_size <= fast_bin_size && heap->fast_bins[adjusted_size / 16] != NULL)
+		return pop_fast_bin(adjusted_size, size);
+
+	int64 *rp = (int64*)find_or_extend(adjusted_size);
+	if (rp == NULL)
+		return NULL;
+
+	place(rp, adjusted_size, size);
+	return rp;
+}
+
+/**
+ * Round a region size up to the smallest size class that holds it. Sizes
+ * above the largest class are left as they are.
+ */
+static size_t class_size(size_t adjusted_size)
+{
+	if (adjusted_size > size_classes[SIZE_CLASS_COUNT - 1])
+		return adjusted_size;
+
+	int lo = 0, hi = SIZE_CLASS_COUNT - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (size_classes[mid] < adjusted_size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return size_classes[lo];
+}
+
+/**
+ * Find a free region of at least adjusted_size bytes, extending the heap if
+ * there is none.
+ * @return the free region, or NULL with ERRNO set to ENOMEM.
+ */
+static void *find_or_extend(size_t adjusted_size)
+{
 	// Search the free list for a fit
 	// The first time malloc is called, this should return NULL.
 	int64 *rp = (int64*)find_fit(adjusted_size);
 	if (rp != NULL)
 	{
-	 	#ifdef NEXT
-	 		// set next-fit pointer to the next link of rp
-			next_free_pointer = (int64*)GET(FORWARD_LINK(HEADER_ADDRESS(rp)));
-		#endif	
+		// set next-fit pointer to the next link of rp
+		if (heap->policy & SF_POLICY_NEXT)
+			heap->next_free_pointer = (int64*)GET(FORWARD_LINK(HEADER_ADDRESS(rp)));
 
-		place(rp, adjusted_size, size);
 		return rp;
 	}
 
+	#ifdef DEFERRED
+		// The space freed since the last sweep may be enough without growing.
+		if (heap->pending_count > 0)
+		{
+			sweep_pending();
+			return find_or_extend(adjusted_size);
+		}
+	#endif
+
+	// So may the regions sitting in the fast bins.
+	if (heap->fast_bin_regions > 0)
+	{
+		consolidate_fast_bins();
+		return find_or_extend(adjusted_size);
+	}
+
 	// No fit found. Get more memory and place the block.
 	// For anything under 4 KB we can just increase the heap by 4 KB.
 	// However, if the malloc request is over 4KB and we don't have a fit we must
@@ -118,689 +292,2905 @@ static void* allocate(size_t size)
 	int64 factor = adjusted_size / FOUR_KB;
 	int64 inc_by = (factor + 1) * FOUR_KB;
 
-	if (heap_size < FOUR_KB)
+	if (heap->heap_size < FOUR_KB)
 	{
 		// this is the case where malloc is called for the first time.
 		// the heap is only 4 words big.
-		rp = (int64*)extend_heap(inc_by - heap_size);
+		rp = (int64*)extend_heap(ALIGN_UP(adjusted_size + heap->heap_size, FOUR_KB) - heap->heap_size);
 	}
 	else
 	{
 		rp = (int64*)extend_heap(inc_by);
 	}
 
+	// The pressure callbacks run on the way to a refused extension may have
+	// freed enough for a fit.
+	if (rp == NULL)
+	{
+		coalesce_deferred_frees();
+		rp = (int64*)find_fit(adjusted_size);
+	}
+
 	if (rp == NULL)
 	{
 		errno = ENOMEM;
 		return NULL;
 	}
 
- 	#ifdef NEXT
- 		// set next-fit pointer to the next link of rp
-		next_free_pointer = (int64*)GET(FORWARD_LINK(HEADER_ADDRESS(rp)));
-	#endif
+	// set next-fit pointer to the next link of rp
+	if (heap->policy & SF_POLICY_NEXT)
+		heap->next_free_pointer = (int64*)GET(FORWARD_LINK(HEADER_ADDRESS(rp)));
 
-	place(rp, adjusted_size, size);
 	return rp;
 }
 
-void sf_free(void *ptr)
-{
-	#ifdef DEBUG
-		printf("\nCall to free - %p\n", ptr);
-	#endif
-	if (!is_valid_heap_ptr(ptr))
-		return;
-
-	// 1. Mark block as free
-	// 2. Coalesce adjacent free blocks
-	// 3. Insert free block into the free list.
-	// 		LIFO policy
-	// 			Insert freed block at the beginning of the free list
-	// 		Address-ordered policy
-	// 			Insert freed block so that free list blocks are always in address order
-	int64* rp = (int64*)ptr;
-
-	size_t size_to_free = GET_REGION_SIZE(HEADER_ADDRESS(rp));
-
-	PUT(HEADER_ADDRESS(rp), PACK(0, size_to_free, FREE));
-	PUT(FOOTER_ADDRESS(rp), PACK(0, size_to_free, FREE));
-
-	coalesce(rp);
-}
-
-void* sf_realloc(void *ptr, size_t size)
+void** sf_comalloc(size_t n, const size_t sizes[], void *ptrs[])
 {
 	errno = 0;
 
 	#ifdef DEBUG
-		printf("\nCall to realloc() - size: %lu", size);
-		printf("\nAddress: %p", ptr);
+		printf("\nCall to comalloc() - %lu objects", n);
 	#endif
 
-	// Ignore spurious requests
-	if (size <= 0)
-		return NULL;
+	// Everything that stays in the heap is laid out back to back in one region.
+	size_t total = 0;
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		if (sizes[i] > FOUR_GB)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		if (sizes[i] > 0 && sizes[i] < large_threshold)
+			total += REGION_SIZE(sizes[i]);
+	}
 
-	// Disallow large requests
-	if (size > FOUR_GB)
+	if (total > MAX)
 	{
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	sf_free(ptr);
-	return allocate(size);
-}
-
-void* sf_calloc(size_t nmemb, size_t size)
-{
-	errno = 0;
-
-	#ifdef DEBUG
-		printf("\nCall to calloc() - size: %lu", size);
-	#endif
-
-	// Ignore spurious requests
-	if (nmemb <= 0 || size <= 0)
-		return NULL;
-
-	// Disallow large requests
-	if (size * nmemb > FOUR_GB)
+	int64* rp = NULL;
+	if (total > 0)
 	{
-		errno = ENOMEM;
-		return NULL;
+		rp = (int64*)find_or_extend(total);
+		if (rp == NULL)
+			return NULL;
 	}
 
-	void* allocated_region = allocate(nmemb * size);
+	for (i = 0; i < n; i++)
+	{
+		ptrs[i] = NULL;
+		if (sizes[i] == 0 || sizes[i] >= large_threshold)
+			continue;
+
+		// Every place but the last splits off the rest, which is the next free region.
+		place(rp, REGION_SIZE(sizes[i]), sizes[i]);
+		ptrs[i] = sample_allocation(rp, sizes[i]);
+		trace(SF_TRACE_MALLOC, ptrs[i], 0, sizes[i]);
+		rp = (int64*)NEXT_REGION(rp);
+	}
 
-	// zero out the memory
-	void* iter = allocated_region;
-	void* footer = FOOTER_ADDRESS(allocated_region);
-	while (iter != footer)
+	for (i = 0; i < n; i++)
 	{
-		PUT(iter, 0x0);
-		iter =  (char*)iter + WSIZE;
+		if (sizes[i] < large_threshold)
+			continue;
+
+		ptrs[i] = allocate_large(sizes[i], DSIZE);
+		if (ptrs[i] == NULL)
+		{
+			// Nothing is handed out unless everything is.
+			int saved_errno = errno;
+			sf_free_batch(ptrs, n);
+			errno = saved_errno;
+			return NULL;
+		}
+		ptrs[i] = sample_allocation(ptrs[i], sizes[i]);
+		trace(SF_TRACE_MALLOC, ptrs[i], 0, sizes[i]);
 	}
-	return allocated_region;
+
+	return ptrs;
 }
 
-void sf_snapshot()
+void sf_free_batch(void **ptrs, size_t n)
 {
-	// Make sure user requested for heap space.
-	if (GET_ALLOC(freelist_pointer) == FREE)
-	{
-		printf("Explicit 8 %lu\n\n", heap_size);
-		/*
-			08/23/12 - 12:40AM		# use strftime
-			0x00095040 8
-			0x0010a058 16
-		 */
-		
-		char buffer[256];	
-  		time_t curtime;
-  		struct tm *loctime;
+	#ifdef DEBUG
+		printf("\nCall to free_batch() - %lu pointers\n", n);
+	#endif
 
-		/* Get the current time. */
-		curtime = time(NULL);
+	// In address order one walk of the heap validates every pointer, and
+	// neighbours end up next to each other.
+	qsort(ptrs, n, sizeof(void*), compare_addresses);
 
-		/* Convert it to local time representation. */
-		loctime = localtime (&curtime);
+	// Runs are freed without free_region, so drop their samples up front.
+	for (size_t i = 0; i < n && sample_count > 0; i++)
+		drop_sample(ptrs[i]);
 
-   		strftime (buffer, 256, "# %m/%d/%y - %I:%M%p\n", loctime);
-		printf("%s\n", buffer);
+	char* hp = NEXT_WORD(heap->prologue_footer);
+	size_t i = 0;
+	while (i < n)
+	{
+		void* ptr = ptrs[i];
+		if (ptr == NULL)
+		{
+			i++;
+			continue;
+		}
 
-		void* ptr = freelist_pointer; // head of first free region
-		printf("%p %lu\n", ptr, GET_REGION_SIZE(ptr));
-		ptr = (void*)GET(FORWARD_LINK(ptr));
+		if (is_large_ptr(ptr))
+		{
+			trace(SF_TRACE_FREE, ptr, 0, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+			free_large(ptr);
+			i++;
+			continue;
+		}
 
-		while (ptr != freelist_pointer)
+		while (hp != (char*)heap->epilogue_header && (void*)NEXT_WORD(hp) < ptr)
+			hp += GET_REGION_SIZE(hp);
+
+		if (hp == (char*)heap->epilogue_header || (void*)NEXT_WORD(hp) != ptr || GET_ALLOC(hp) != ALLOCATED || is_pending(hp))
 		{
-			printf("%p %lu\n", ptr, GET_REGION_SIZE(ptr));
-			ptr = (void*)GET(FORWARD_LINK(ptr));
+			#ifdef DEBUG
+				printf("invalid pointer! cannot free! - %p\n", ptr);
+			#endif
+			i++;
+			continue;
+		}
+
+		// Take in every following pointer to the very next region, so the
+		// whole run is freed with a single coalesce.
+		trace(SF_TRACE_FREE, NEXT_WORD(hp), 0, GET_REQUESTED_SIZE(hp));
+		untag_region(NEXT_WORD(hp));
+		heap->requested_bytes -= GET_REQUESTED_SIZE(hp);
+		char* run_end = hp + GET_REGION_SIZE(hp);
+		i++;
+		while (i < n && ptrs[i] == NEXT_WORD(run_end) &&
+			run_end != (char*)heap->epilogue_header && GET_ALLOC(run_end) == ALLOCATED && !is_pending(run_end))
+		{
+			trace(SF_TRACE_FREE, NEXT_WORD(run_end), 0, GET_REQUESTED_SIZE(run_end));
+			untag_region(NEXT_WORD(run_end));
+			heap->requested_bytes -= GET_REQUESTED_SIZE(run_end);
+			run_end += GET_REGION_SIZE(run_end);
+			i++;
 		}
 
+		size_t size = run_end - hp;
+		heap->allocated_bytes -= size;
+		PUT(hp, PACK(0, size, FREE));
+		PUT(run_end - WSIZE, PACK(0, size, FREE));
+		coalesce(NEXT_WORD(hp));
+
+		// The region after the run still has its header, even if it was merged.
+		hp = run_end;
 	}
-}
 
-/**
- * Print information about heap when debugging.
- */
-void print_heap_stats()
-{
-	printf("\nCURRENT HEAP STATS\n");
-	printf("heap_start: %p\n", heap_start);
-	printf("prologue_header: %p - %lu\n", prologue_header, GET(prologue_header));
-	printf("prologue_footer: %p - %lu\n", prologue_footer, GET(prologue_footer));
-	printf("epilogue_header: %p - %lu\n", epilogue_header, GET(epilogue_header));
-	printf("heap_size: %lu\n", heap_size);
-	printf("freelist_pointer: %p\n", freelist_pointer);
-	#ifdef NEXT
-		printf("next_free_pointer: %p\n", next_free_pointer);
-	#else
-		printf("\n");
-	#endif
+	trim_heap(false);
 }
 
-/**
- * Increases heap by size if there is enough memory.
- * @return the pointer to the now newly acquired free region
- */
-static void *extend_heap(size_t size)
+void sf_free(void *ptr)
 {
-	if (heap_size + size > MAX)
+	#ifdef DEBUG
+		printf("\nCall to free - %p\n", ptr);
+	#endif
+	if (is_large_ptr(ptr))
 	{
-		errno = ENOMEM;
-		return NULL;
+		trace(SF_TRACE_FREE, ptr, 0, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+		free_large(ptr);
+		return;
 	}
-	
-	int64* rp;
-	rp = (int64*)sbrk(size);
 
-	heap_size += size;
-	
+	if (!is_valid_heap_ptr(ptr))
+		return;
+
+	trace(SF_TRACE_FREE, ptr, 0, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+	free_region(ptr);
+}
+
+void sf_free_sized(void *ptr, size_t size)
+{
 	#ifdef DEBUG
-		printf("extending heap size to: %lu\n", heap_size);
-		printf("previous top of heap: %p\n", rp);
-		printf("new top of heap: %p\n", sbrk(0));
+		printf("\nCall to free_sized - %p, size: %lu\n", ptr, size);
 	#endif
 
-	// Initialize the free block header/footer of the free region
-	PUT(HEADER_ADDRESS(rp), PACK(0, size, FREE)); 
-	PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE));	
-
-	// New epilogue header
-	epilogue_header = (int64*)NEXT_HEADER_ADDRESS(rp);
-	PUT(epilogue_header, PACK(0, 0, ALLOCATED));
+	if (ptr == NULL)
+		return;
 
-	// If this is the first time we call malloc, indicated by heap_size:
-	// Create the first link for the free list - a circular link back to itself.
-	if (heap_size == FOUR_KB)
+	// Anything outside the heap can only be a large object.
+	if ((int64*)ptr <= heap->prologue_footer || (int64*)ptr >= heap->epilogue_header)
 	{
+		if (!is_large_ptr(ptr))
+			return;
+
 		#ifdef DEBUG
-			printf("First extension of heap. Initializing free list.\n");
+			if (GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)) != size)
+			{
+				printf("size mismatch! cannot free! - %p, header says %lu\n", ptr, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+				return;
+			}
 		#endif
 
-		// circular link to inicate only 1 free region at the moment
-		PUT(FORWARD_LINK(freelist_pointer), (int64)freelist_pointer);
-		PUT(BACK_LINK(freelist_pointer), (int64)freelist_pointer);
+		trace(SF_TRACE_FREE, ptr, 0, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+		free_large(ptr);
+		return;
 	}
 
-	// Coalesce if the previous block was free
-	return coalesce(rp);
+	// The caller vouches for ptr, so skip the heap walk. Debug builds still do
+	// it and check the size against the header.
+	#ifdef DEBUG
+		if (!is_valid_heap_ptr(ptr))
+			return;
+		if (GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)) != size || GET_REGION_SIZE(HEADER_ADDRESS(ptr)) < REGION_SIZE(size))
+		{
+			printf("size mismatch! cannot free! - %p, header says %lu\n", ptr, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+			return;
+		}
+	#endif
+
+	if (GET_ALLOC(HEADER_ADDRESS(ptr)) != ALLOCATED)
+		return;
+
+	trace(SF_TRACE_FREE, ptr, 0, GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr)));
+	free_region(ptr);
 }
 
+static int compare_addresses(const void *a, const void *b)
+{
+	uintptr_t left = (uintptr_t)*(void* const*)a;
+	uintptr_t right = (uintptr_t)*(void* const*)b;
+	return left < right ? -1 : left > right;
+}
 
 /**
- * Find a free region that fits the size.
- * This function uses a explicit freelist using either first-fit or next-fit 
- * depending on the given flag.
+ * Free a region in the heap. ptr must already be validated.
  */
-static void *find_fit(size_t size)
+static void free_region(void *ptr)
 {
-	// This is the case where there are no free regions.
-	if (GET_ALLOC(freelist_pointer) == ALLOCATED)
-	{
-		#ifdef DEBUG
-			printf("No free regions. We must extend the heap.\n");
-		#endif
-		return NULL;
-	}
+	// 1. Mark block as free
+	// 2. Coalesce adjacent free blocks
+	// 3. Insert free block into the free list.
+	// 		LIFO policy
+	// 			Insert freed block at the beginning of the free list
+	// 		Address-ordered policy
+	// 			Insert freed block so that free list blocks are always in address order
+	int64* rp = (int64*)ptr;
 
-	int64* start_ptr;
-	#ifdef NEXT
-		start_ptr = next_free_pointer;
-	#else
-		start_ptr = freelist_pointer;
-	#endif
+	// Freed already, and waiting for the sweep.
+	if (is_pending(HEADER_ADDRESS(rp)))
+		return;
+
+	drop_sample(ptr);
+	untag_region(ptr);
 
-	if (GET_REGION_SIZE(start_ptr) >= size)
+	size_t size_to_free = GET_REGION_SIZE(HEADER_ADDRESS(rp));
+
+	heap->allocated_bytes -= size_to_free;
+	heap->requested_bytes -= GET_REQUESTED_SIZE(HEADER_ADDRESS(rp));
+
+	if (size_to_free <= fast_bin_size)
 	{
-		#ifdef DEBUG
-			printf("Free region found at first address! - %p.\n", start_ptr);
-			printf("This region has a size of %lu.\n", GET_REGION_SIZE(start_ptr));
-		#endif
-		return NEXT_WORD(start_ptr);
+		// Stay allocated to the neighbours, with no requested size, until the
+		// next request of this size takes it back or the bins are consolidated.
+		size_t bin = size_to_free / 16;
+		PUT(HEADER_ADDRESS(rp), PACK(0, size_to_free, ALLOCATED));
+		PUT(FOOTER_ADDRESS(rp), PACK(0, size_to_free, ALLOCATED));
+		PUT(rp, (int64)heap->fast_bins[bin]);
+		heap->fast_bins[bin] = rp;
+		heap->fast_bin_regions++;
+		heap->fast_bin_bytes += size_to_free;
+
+		if (++heap->fast_bin_counts[bin] == FAST_BIN_LIMIT)
+			consolidate_fast_bins();
+		return;
 	}
 
-	// recursively check every free pointer after the start_ptr recursively.
-	// Pass the address pointed to by start_ptr
-	int64* next_address = (int64*)(*(int64*)FORWARD_LINK(start_ptr));
-	return find_fit_recursive(next_address, size);
+	#ifdef DEFERRED
+		// Stay allocated to the neighbours, with no requested size to mark it
+		// pending, until sweep_pending coalesces it.
+		PUT(HEADER_ADDRESS(rp), PACK(0, size_to_free, ALLOCATED));
+		PUT(FOOTER_ADDRESS(rp), PACK(0, size_to_free, ALLOCATED));
 
+		heap->pending[heap->pending_count++] = rp;
+		heap->pending_bytes += size_to_free;
+		if (heap->pending_count == DEFERRED_THRESHOLD)
+			sweep_pending();
+	#else
+		PUT(HEADER_ADDRESS(rp), PACK(0, size_to_free, FREE));
+		PUT(FOOTER_ADDRESS(rp), PACK(0, size_to_free, FREE));
 
-	// Next placement strategy
-	// keep track of where previous search finished. 
-	// then check in order until we find a big enough space.
+		coalesce(rp);
 
+		// Give memory back if the top of the heap is now a large free region.
+		trim_heap(false);
+	#endif
 }
 
 /**
- * Iterate through a circular linked list to find a region of size size
- * @param fp header of a free region
+ * Whether the allocated region hp was freed already and waits in a fast bin,
+ * or with -DDEFERRED in the pending list. Only those regions have no
+ * requested size; fence regions have none either, but they were never handed
+ * out to be freed.
  */
-static void *find_fit_recursive(void *fp, size_t size)
+static bool is_pending(void *hp)
 {
-	#ifdef DEBUG
-		printf("\nSearching for free region recursively...");
-	#endif
-
-	int64* start_ptr;
-	#ifdef NEXT
-		start_ptr = next_free_pointer;
-	#else
-		start_ptr = freelist_pointer;
-	#endif
-
-	// BASE CASE: stop when we reach start_ptr again.
-	if (fp == start_ptr) {
-		#ifdef DEBUG
-			printf("No free regions of size %lu.\n", size);
-		#endif
-		return NULL;
-	}
+	return GET_REQUESTED_SIZE(hp) == 0;
+}
 
-	int64 region_size = GET_REGION_SIZE(fp);
+#ifdef DEFERRED
 
+/**
+ * Free the pending regions for real, coalescing each the way sf_free would
+ * have. Runs when the pending list is full and before the heap grows.
+ */
+static void sweep_pending()
+{
 	#ifdef DEBUG
-		printf("Checking %p.\n", fp);
-		printf("This region has a size of %lu.\n", region_size);
+		printf("sweeping %lu pending regions\n", heap->pending_count);
 	#endif
 
-	if (region_size >= size)
+	// A region swept earlier in the loop only merges with a pending neighbour
+	// once that neighbour's turn comes, since it still looks allocated.
+	size_t i;
+	for (i = 0; i < heap->pending_count; i++)
 	{
-		#ifdef DEBUG
-			printf("Free region found at address! - %p.\n", fp);
-			printf("\n");
-		#endif
-
-		return NEXT_WORD(fp);
+		int64* rp = heap->pending[i];
+		size_t size = GET_REGION_SIZE(HEADER_ADDRESS(rp));
+		PUT(HEADER_ADDRESS(rp), PACK(0, size, FREE));
+		PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE));
+		coalesce(rp);
 	}
+	heap->pending_count = 0;
+	heap->pending_bytes = 0;
 
-	int64* next_address = (int64*)(*(int64*)FORWARD_LINK(fp));
-	return find_fit_recursive(next_address, size);
-
+	trim_heap(false);
 }
 
+#endif
+
 /**
- * Place the requested region at the beginning of the free region, splitting
- * only if the size of the remainder would equal or exceed the minimum block size.
- * ptr MUST be a free region.
+ * Hand out the region freed most recently to the fast bin of adjusted_size,
+ * without touching the free list.
  */
-static void place(void *ptr, size_t adjusted_size, size_t requested_size)
+static void *pop_fast_bin(size_t adjusted_size, size_t requested_size)
 {
-	if (GET_ALLOC(ptr) != FREE)
-	{
-		#ifdef DEBUG
-			printf("ERROR. CALLING place() ON ALREADY ALLOCATED REGION!\n\n");
-		#endif
-		return;
-	}
+	size_t bin = adjusted_size / 16;
+	int64* rp = heap->fast_bins[bin];
+	heap->fast_bins[bin] = (int64*)GET(rp);
+	heap->fast_bin_counts[bin]--;
+	heap->fast_bin_regions--;
+	heap->fast_bin_bytes -= adjusted_size;
 
-	int64* rp = (int64*)ptr;
+	PUT(HEADER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+	PUT(FOOTER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
 
-	int64 free_region_size = GET_REGION_SIZE(HEADER_ADDRESS(rp)); // size of the current free region
+	heap->allocated_bytes += adjusted_size;
+	heap->requested_bytes += requested_size;
+	placed_dirty_end = (char*)FOOTER_ADDRESS(rp);
+	return rp;
+}
+
+/**
+ * Free every region in the fast bins for real, coalescing each the way
+ * sf_free would have. Runs when a bin is full and before the heap grows.
+ */
+static void consolidate_fast_bins()
+{
+	#ifdef DEBUG
+		printf("consolidating %lu fast bin regions\n", heap->fast_bin_regions);
+	#endif
+
+	size_t bin;
+	for (bin = 0; bin < FAST_BIN_COUNT; bin++)
+	{
+		int64* rp = heap->fast_bins[bin];
+		while (rp != NULL)
+		{
+			// coalesce writes the free list links over the bin link.
+			int64* next = (int64*)GET(rp);
+			size_t size = GET_REGION_SIZE(HEADER_ADDRESS(rp));
+			PUT(HEADER_ADDRESS(rp), PACK(0, size, FREE));
+			PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE));
+			coalesce(rp);
+			rp = next;
+		}
+		heap->fast_bins[bin] = NULL;
+		heap->fast_bin_counts[bin] = 0;
+	}
+	heap->fast_bin_regions = 0;
+	heap->fast_bin_bytes = 0;
+
+	trim_heap(false);
+}
+
+/**
+ * Coalesce every region of the current heap that was freed to a fast bin or,
+ * with -DDEFERRED, to the pending list, so searches and trim_heap see it.
+ */
+static void coalesce_deferred_frees()
+{
+	#ifdef DEFERRED
+		if (heap->pending_count > 0)
+			sweep_pending();
+	#endif
+
+	if (heap->fast_bin_regions > 0)
+		consolidate_fast_bins();
+}
+
+void* sf_realloc(void *ptr, size_t size)
+{
+	errno = 0;
+
+	#ifdef DEBUG
+		printf("\nCall to realloc() - size: %lu", size);
+		printf("\nAddress: %p", ptr);
+	#endif
+
+	// Ignore spurious requests
+	if (size <= 0)
+		return NULL;
+
+	// Disallow large requests
+	if (size > FOUR_GB)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void* new_ptr;
+	bool is_large = is_large_ptr(ptr);
+	if (ptr == NULL || (!is_large && !is_valid_heap_ptr(ptr)))
+		new_ptr = sample_allocation(allocate(size), size);
+	else
+		new_ptr = reallocate(ptr, size, is_large);
+
+	trace(SF_TRACE_REALLOC, new_ptr, (int64)ptr, size);
+	return new_ptr;
+}
+
+/**
+ * Resize an allocated region. ptr must already be validated.
+ */
+static void *reallocate(void *ptr, size_t size, bool is_large)
+{
+	// The tag goes wherever the data goes. It is off during the resize so
+	// freeing the old region does not count against it.
+	size_t tag = get_tag(ptr);
+	untag_region(ptr);
+
+	void* new_ptr = resize(ptr, size, is_large);
+	if (tag != 0)
+		tag_region(new_ptr != NULL ? new_ptr : ptr, tag);
+	if (new_ptr == NULL)
+		return NULL;
+
+	// To the profiler a realloc is a free and a malloc, even in place.
+	drop_sample(ptr);
+	return sample_allocation(new_ptr, size);
+}
+
+/**
+ * reallocate without the profiling.
+ */
+static void *resize(void *ptr, size_t size, bool is_large)
+{
+	size_t old_size = GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr));
+	bool growing = size > old_size;
+
+	// Growth into the slack the region already has needs no move.
+	if (growing && size <= usable_size(ptr, is_large))
+	{
+		set_requested_size(ptr, size);
+		return ptr;
+	}
+
+	// A region that grows a second time is most likely being appended to.
+	// Give it room to double, so the next reallocs land in place.
+	size_t target = size;
+	if (growing && GET_GROWING(HEADER_ADDRESS(ptr)) && old_size * 2 > size)
+		target = old_size * 2 < MAX ? old_size * 2 : MAX;
+
+	// Large objects that stay large are remapped instead of copied.
+	if (is_large && size >= large_threshold)
+	{
+		void* new_ptr = realloc_large(ptr, target);
+		if (new_ptr == NULL && target != size)
+			new_ptr = realloc_large(ptr, size);
+		if (new_ptr != NULL && growing)
+			set_requested_size(new_ptr, size);
+		return new_ptr;
+	}
+
+	// Allocate before freeing so the old region is untouched if we run out of memory.
+	void* new_ptr = allocate(target);
+	if (new_ptr == NULL && target != size)
+		new_ptr = allocate(size);
+	if (new_ptr == NULL)
+		return NULL;
+
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+
+	if (is_large)
+		free_large(ptr);
+	else
+		free_region(ptr);
+
+	if (growing)
+		set_requested_size(new_ptr, size);
+
+	return new_ptr;
+}
+
+size_t sf_malloc_usable_size(void *ptr)
+{
+	if (is_large_ptr(ptr))
+		return usable_size(ptr, true);
+
+	if (!is_valid_heap_ptr(ptr))
+		return 0;
+
+	return usable_size(ptr, false);
+}
+
+/**
+ * Usable bytes of an allocated region. ptr must already be validated.
+ */
+static size_t usable_size(void *ptr, bool is_large)
+{
+	if (is_large)
+		return LARGE_SEGMENT(ptr)->map_size - GET_REGION_SIZE(HEADER_ADDRESS(ptr));
+
+	return GET_REGION_SIZE(HEADER_ADDRESS(ptr)) - 2 * WSIZE;
+}
+
+/**
+ * Record a new requested size for a region sf_realloc grew, and mark it as
+ * growing. The region size and other flags stay as they are.
+ */
+static void set_requested_size(void *ptr, size_t size)
+{
+	if (!GET_LARGE(HEADER_ADDRESS(ptr)))
+		heap->requested_bytes += size - GET_REQUESTED_SIZE(HEADER_ADDRESS(ptr));
+
+	int64 header = (GET(HEADER_ADDRESS(ptr)) & 0xFFFFFFFF) | GROWING;
+	PUT(HEADER_ADDRESS(ptr), PACK((int64)size, header, 0));
+
+	// Large objects have no footer.
+	if (!GET_LARGE(HEADER_ADDRESS(ptr)))
+		PUT(FOOTER_ADDRESS(ptr), GET(HEADER_ADDRESS(ptr)));
+}
+
+void* sf_calloc(size_t nmemb, size_t size)
+{
+	errno = 0;
+
+	#ifdef DEBUG
+		printf("\nCall to calloc() - size: %lu", size);
+	#endif
+
+	// Ignore spurious requests
+	if (nmemb <= 0 || size <= 0)
+		return NULL;
+
+	// Disallow large requests, including ones whose size overflows
+	size_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total) || total > FOUR_GB)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void* allocated_region = sample_allocation(allocate(total), total);
+	trace(SF_TRACE_CALLOC, allocated_region, nmemb, size);
+	if (allocated_region == NULL)
+		return NULL;
+
+	// Large objects come straight from mmap and are already zero.
+	if (is_large_ptr(allocated_region))
+		return allocated_region;
+
+	// Past placed_dirty_end the payload is fresh memory, where only the old
+	// free list links need clearing.
+	PUT(allocated_region, 0x0);
+	PUT(NEXT_WORD(allocated_region), 0x0);
+	if (placed_dirty_end > (char*)allocated_region)
+		zero_payload(allocated_region, ALIGN_UP(placed_dirty_end - (char*)allocated_region, DSIZE));
+	return allocated_region;
+}
+
+void* sf_aligned_alloc(size_t alignment, size_t size)
+{
+	errno = 0;
+
+	#ifdef DEBUG
+		printf("\nCall to aligned_alloc() - alignment: %lu size: %lu", alignment, size);
+	#endif
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// Ignore spurious requests
+	if (size <= 0)
+		return NULL;
+
+	// Disallow large requests
+	// A payload offset of FOUR_GB would not fit the header of a large object.
+	if (size > FOUR_GB || alignment >= FOUR_GB)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void* ptr = sample_allocation(allocate_aligned(alignment, size), size);
+	trace(SF_TRACE_ALIGNED, ptr, alignment, size);
+	return ptr;
+}
+
+int sf_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void *) != 0)
+		return EINVAL;
+
+	int saved_errno = errno;
+	void* ptr = sf_aligned_alloc(alignment, size);
+	int result = errno;
+	errno = saved_errno;
+
+	if (ptr == NULL && result != 0)
+		return result;
+
+	*memptr = ptr;
+	return 0;
+}
+
+/**
+ * Allocate size bytes at a multiple of alignment. Anything up to DSIZE is what
+ * allocate gives anyway. Otherwise the aligned region is carved out of a free
+ * region, and the gap in front of it is split off as its own free region.
+ */
+static void *allocate_aligned(size_t alignment, size_t size)
+{
+	if (alignment <= DSIZE)
+		return allocate(size);
+
+	if (size >= large_threshold)
+		return allocate_large(size, alignment);
+
+	size_t adjusted_size = REGION_SIZE(size);
+
+	void* hp = find_fit_aligned(adjusted_size, alignment);
+
+	#ifdef DEFERRED
+		if (hp == NULL && heap->pending_count > 0)
+		{
+			sweep_pending();
+			hp = find_fit_aligned(adjusted_size, alignment);
+		}
+	#endif
+
+	if (hp == NULL && heap->fast_bin_regions > 0)
+	{
+		consolidate_fast_bins();
+		hp = find_fit_aligned(adjusted_size, alignment);
+	}
+
+	if (hp == NULL)
+	{
+		// Enough for the region, the worst alignment gap, and the free region in the gap.
+		void* fp = extend_heap(ALIGN_UP(adjusted_size + alignment + MIN_REGION_SIZE, FOUR_KB));
+		if (fp != NULL)
+			hp = HEADER_ADDRESS(fp);
+		else
+		{
+			coalesce_deferred_frees();
+			hp = find_fit_aligned(adjusted_size, alignment);
+		}
+	}
+
+	void* rp = hp != NULL ? aligned_payload(hp, adjusted_size, alignment) : NULL;
+	if (rp == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	place_aligned(hp, rp, adjusted_size, size);
+	return rp;
+}
+
+struct sf_arena* sf_arena_create(size_t initial)
+{
+	errno = 0;
+
+	#ifdef DEBUG
+		printf("\nCall to arena_create() - initial: %lu", initial);
+	#endif
+
+	if (initial == 0)
+		initial = ARENA_DEFAULT_CHUNK;
+
+	if (initial > FOUR_GB)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t size = sizeof(struct sf_arena_chunk) + sizeof(struct sf_arena) + initial;
+	struct sf_arena_chunk *chunk = arena_chunk(NULL, size);
+	if (chunk == NULL)
+		return NULL;
+
+	struct sf_arena *arena = (struct sf_arena*)(chunk + 1);
+	arena->chunk = chunk;
+	arena->top = (char*)(arena + 1);
+	arena->next_chunk_size = size * 2 < ARENA_MAX_CHUNK ? size * 2 : ARENA_MAX_CHUNK;
+
+	return arena;
+}
+
+void* sf_arena_alloc(struct sf_arena *arena, size_t size)
+{
+	errno = 0;
+
+	if (size == 0)
+		return NULL;
+
+	if (size > FOUR_GB)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size = ALIGN_UP(size, DSIZE);
+	if (size > (size_t)(arena->chunk->end - arena->top))
+	{
+		size_t chunk_size = sizeof(struct sf_arena_chunk) + size;
+		if (chunk_size < arena->next_chunk_size)
+			chunk_size = arena->next_chunk_size;
+
+		struct sf_arena_chunk *chunk = arena_chunk(arena->chunk, chunk_size);
+		if (chunk == NULL)
+			return NULL;
+
+		#ifdef DEBUG
+			printf("arena %p chained in a chunk of %lu bytes at %p\n", arena, chunk_size, chunk);
+		#endif
+
+		arena->chunk = chunk;
+		arena->top = (char*)(chunk + 1);
+		arena->next_chunk_size = chunk_size * 2 < ARENA_MAX_CHUNK ? chunk_size * 2 : ARENA_MAX_CHUNK;
+	}
+
+	void* ptr = arena->top;
+	arena->top += size;
+	return ptr;
+}
+
+struct sf_arena_position sf_arena_mark(struct sf_arena *arena)
+{
+	struct sf_arena_position mark = { arena->chunk, arena->top };
+	return mark;
+}
+
+void sf_arena_release(struct sf_arena *arena, struct sf_arena_position mark)
+{
+	while (arena->chunk != mark.chunk)
+	{
+		struct sf_arena_chunk *chunk = arena->chunk;
+		arena->chunk = chunk->prev;
+		free_arena_chunk(chunk);
+	}
+
+	arena->top = mark.top;
+}
+
+void sf_arena_reset(struct sf_arena *arena)
+{
+	// The first chunk is the one holding the arena itself.
+	struct sf_arena_position start = { (struct sf_arena_chunk*)arena - 1, (char*)(arena + 1) };
+	sf_arena_release(arena, start);
+}
+
+void sf_arena_destroy(struct sf_arena *arena)
+{
+	#ifdef DEBUG
+		printf("\nCall to arena_destroy() - %p\n", arena);
+	#endif
+
+	struct sf_arena_chunk *chunk = arena->chunk;
+	while (chunk != NULL)
+	{
+		struct sf_arena_chunk *prev = chunk->prev;
+		free_arena_chunk(chunk);
+		chunk = prev;
+	}
+}
+
+/**
+ * Allocate an arena chunk of size bytes, including its header. Any padding
+ * the allocator adds is used too.
+ */
+static struct sf_arena_chunk *arena_chunk(struct sf_arena_chunk *prev, size_t size)
+{
+	struct sf_arena_chunk *chunk = allocate(size);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->prev = prev;
+	chunk->end = (char*)chunk + usable_size(chunk, is_large_ptr(chunk));
+	return chunk;
+}
+
+/**
+ * Take an unused handle table entry, growing the table when there is none.
+ * @return The handle, or 0 with ERRNO set to ENOMEM.
+ */
+static sf_handle new_handle()
+{
+	if (free_handles == 0)
+	{
+		size_t capacity = handle_capacity == 0 ? FOUR_KB / sizeof(struct sf_handle_entry) : handle_capacity * 2;
+		size_t map_size = capacity * sizeof(struct sf_handle_entry);
+
+		// The table is indexed by handle, so moving it with mremap is fine.
+		struct sf_handle_entry *table;
+		if (handle_table == NULL)
+			table = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		else
+			table = mremap(handle_table, handle_capacity * sizeof(struct sf_handle_entry), map_size, MREMAP_MAYMOVE);
+
+		if (table == MAP_FAILED)
+		{
+			errno = ENOMEM;
+			return 0;
+		}
+
+		// Chain the new entries, keeping entry 0 out.
+		size_t first = handle_capacity == 0 ? 1 : handle_capacity;
+		size_t i;
+		for (i = capacity - 1; i >= first; i--)
+		{
+			table[i].ptr = NULL;
+			table[i].pins = free_handles;
+			free_handles = i;
+		}
+
+		handle_table = table;
+		handle_capacity = capacity;
+	}
+
+	sf_handle handle = free_handles;
+	free_handles = handle_table[handle].pins;
+	return handle;
+}
+
+static bool is_live_handle(sf_handle handle)
+{
+	return handle != 0 && handle < handle_capacity && handle_table[handle].ptr != NULL;
+}
+
+/**
+ * Whether the allocated region rp belongs to a handle. Only a handle's own
+ * region has its entry pointing right behind the prefix.
+ */
+static bool is_handle_region(void *rp)
+{
+	sf_handle handle = GET(rp);
+	return is_live_handle(handle) && handle_table[handle].ptr == (char*)rp + HANDLE_PREFIX;
+}
+
+/**
+ * Turn the space from start to end, if there is any, into one free region.
+ */
+static void free_gap(char *start, char *end)
+{
+	size_t size = end - start;
+	if (size == 0)
+		return;
+
+	PUT(start, PACK(0, size, FREE));
+	PUT(end - WSIZE, PACK(0, size, FREE));
+	freelist_insert(start);
+}
+
+/**
+ * Give an arena chunk back to the heap.
+ */
+static void free_arena_chunk(struct sf_arena_chunk *chunk)
+{
+	if (is_large_ptr(chunk))
+		free_large(chunk);
+	else
+		free_region(chunk);
+}
+
+struct sf_heap* sf_heap_create(size_t max_size)
+{
+	errno = 0;
+
+	#ifdef DEBUG
+		printf("\nCall to heap_create() - max_size: %lu", max_size);
+	#endif
+
+	if (max_size == 0)
+		max_size = HEAP_DEFAULT_RESERVE;
+
+	// The heap struct takes the start of the mapping and the heap starts after it.
+	size_t map_size = ALIGN_UP(sizeof(struct sf_heap) + max_size, FOUR_KB);
+	struct sf_heap *h = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (h == MAP_FAILED)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	h->brk = (char*)ALIGN_UP(h + 1, DSIZE);
+	h->brk_limit = (char*)h + map_size;
+	h->heap_start = (int64*)h->brk;
+
+	struct sf_heap *saved = heap;
+	heap = h;
+	init_heap();
+	heap = saved;
+
+	h->next = default_heap.next;
+	default_heap.next = h;
+
+	return h;
+}
+
+void* sf_heap_malloc(struct sf_heap *h, size_t size)
+{
+	struct sf_heap *saved = heap;
+	heap = h;
+	void* ptr = sf_malloc(size);
+	heap = saved;
+	return ptr;
+}
+
+void sf_heap_free(struct sf_heap *h, void *ptr)
+{
+	struct sf_heap *saved = heap;
+	heap = h;
+	sf_free(ptr);
+	heap = saved;
+}
+
+void* sf_heap_realloc(struct sf_heap *h, void *ptr, size_t size)
+{
+	struct sf_heap *saved = heap;
+	heap = h;
+	void* new_ptr = sf_realloc(ptr, size);
+	heap = saved;
+	return new_ptr;
+}
+
+void sf_heap_destroy(struct sf_heap *h)
+{
+	#ifdef DEBUG
+		printf("\nCall to heap_destroy() - %p\n", h);
+	#endif
+
+	if (h == NULL || h == &default_heap)
+		return;
+
+	struct sf_heap *prev = &default_heap;
+	while (prev->next != h)
+	{
+		if (prev->next == NULL)
+			return;
+		prev = prev->next;
+	}
+	prev->next = h->next;
+
+	drop_samples_of_heap(h);
+
+	// Large objects are the only memory outside the heap's own mapping.
+	struct large_segment *seg = h->large_list;
+	while (seg != NULL)
+	{
+		struct large_segment *next = seg->next;
+		remove_large(seg->payload);
+		munmap(seg, seg->map_size);
+		seg = next;
+	}
+
+	munmap(h, h->brk_limit - (char*)h);
+}
+
+sf_handle sf_halloc(size_t size)
+{
+	errno = 0;
+
+	#ifdef DEBUG
+		printf("\nCall to halloc() - size: %lu", size);
+	#endif
+
+	if (size == 0)
+		return 0;
+
+	if (size > FOUR_GB - HANDLE_PREFIX)
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+
+	sf_handle handle = new_handle();
+	if (handle == 0)
+		return 0;
+
+	char* rp = allocate(size + HANDLE_PREFIX);
+	if (rp == NULL)
+	{
+		handle_table[handle].pins = free_handles;
+		free_handles = handle;
+		return 0;
+	}
+
+	PUT(rp, handle);
+	handle_table[handle].ptr = rp + HANDLE_PREFIX;
+	handle_table[handle].pins = 0;
+
+	return handle;
+}
+
+void* sf_hpin(sf_handle handle)
+{
+	if (!is_live_handle(handle))
+		return NULL;
+
+	handle_table[handle].pins++;
+	return handle_table[handle].ptr;
+}
+
+void sf_hunpin(sf_handle handle)
+{
+	if (is_live_handle(handle) && handle_table[handle].pins > 0)
+		handle_table[handle].pins--;
+}
+
+void sf_hfree(sf_handle handle)
+{
+	#ifdef DEBUG
+		printf("\nCall to hfree() - %lu\n", handle);
+	#endif
+
+	if (!is_live_handle(handle))
+		return;
+
+	char* rp = (char*)handle_table[handle].ptr - HANDLE_PREFIX;
+	if (is_large_ptr(rp))
+		free_large(rp);
+	else
+		free_region(rp);
+
+	handle_table[handle].ptr = NULL;
+	handle_table[handle].pins = free_handles;
+	free_handles = handle;
+}
+
+size_t sf_compact(int flags)
+{
+	#ifdef DEBUG
+		printf("\nCall to compact()\n");
+	#endif
+
+	#ifdef DEFERRED
+		sweep_pending();
+	#endif
+	consolidate_fast_bins();
+
+	// Every free region gets rewritten, so the free list starts over. The old
+	// free regions ahead of the walk are not in it, and an address ordered
+	// insert would trip over them: link the gaps LIFO and sort once at the end.
+	int policy = heap->policy;
+	heap->policy &= ~SF_POLICY_ADDRESS;
+	heap->freelist_pointer = NULL;
+	heap->free_regions = 0;
+	heap->next_free_pointer = NULL;
+	heap->largest_free = 0;
+	heap->largest_free_dirty = false;
+
+	// Walk the regions by their boundary tags like print_all_regions. dst is
+	// where the next region that can move goes.
+	char* dst = NEXT_WORD(heap->prologue_footer);
+	char* hp = dst;
+	size_t moved = 0;
+	while (hp != (char*)heap->epilogue_header)
+	{
+		size_t size = GET_REGION_SIZE(hp);
+		char* rp = NEXT_WORD(hp);
+
+		if (GET_ALLOC(hp) == FREE)
+		{
+			// The tags of a free region end up inside the gap it is part of.
+			if (dst != hp)
+				clear_tags_above_floor(hp);
+			hp += size;
+			continue;
+		}
+
+		// Regions only move down, so everything from hp on is still in place.
+		if (is_handle_region(rp) && handle_table[GET(rp)].pins == 0)
+		{
+			if (dst != hp)
+			{
+				memmove(dst, hp, size);
+				handle_table[GET(NEXT_WORD(dst))].ptr = NEXT_WORD(dst) + HANDLE_PREFIX;
+				moved += size;
+			}
+			dst += size;
+		}
+		else
+		{
+			// Whatever is left in front of a region that cannot move is free.
+			free_gap(dst, hp);
+			dst = hp + size;
+		}
+
+		hp += size;
+	}
+	free_gap(dst, hp);
+
+	heap->policy = policy;
+	if (policy & SF_POLICY_ADDRESS)
+		convert_to_address_policy();
+
+	#ifdef DEBUG
+		printf("compaction moved %lu bytes\n", moved);
+	#endif
+
+	if (flags & SF_COMPACT_TRIM)
+	{
+		// Trimming under pressure drops the reservation. Compaction should not.
+		char* reserve_floor = heap->reserve_floor;
+		trim_heap(true);
+		heap->reserve_floor = reserve_floor;
+	}
+	else
+		trim_heap(false);
+
+	return moved;
+}
+
+void sf_stats(struct sf_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+	if (heap->heap_start == NULL)
+		return;
+
+	out->heap_size = heap->heap_size;
+	out->requested_bytes = heap->requested_bytes;
+	out->allocated_bytes = heap->allocated_bytes;
+	out->large_bytes = heap->large_bytes;
+	out->extend_calls = heap->extend_calls;
+	out->extend_bytes = heap->extend_bytes;
+	memcpy(out->coalesce_cases, heap->coalesce_cases, sizeof(out->coalesce_cases));
+	out->find_fit_calls = heap->find_fit_calls;
+	if (heap->find_fit_calls != 0)
+		out->find_fit_probes = (double)heap->find_fit_probes / heap->find_fit_calls;
+	out->policy = heap->policy;
+	out->policy_switches = heap->policy_switches;
+
+	out->free_bytes = free_list_bytes();
+	out->fast_bin_bytes = heap->fast_bin_bytes;
+	#ifdef DEFERRED
+		out->pending_bytes = heap->pending_bytes;
+	#endif
+	out->free_regions = heap->free_regions;
+
+	// Only walk the free list if the largest region may have gone since the last walk.
+	if (heap->largest_free_dirty)
+	{
+		heap->largest_free = 0;
+		if (heap->freelist_pointer != NULL)
+		{
+			void* fp = heap->freelist_pointer;
+			do
+			{
+				if (GET_REGION_SIZE(fp) > heap->largest_free)
+					heap->largest_free = GET_REGION_SIZE(fp);
+				fp = (void*)GET(FORWARD_LINK(fp));
+			} while (fp != heap->freelist_pointer);
+		}
+		heap->largest_free_dirty = false;
+	}
+	out->largest_free_region = heap->largest_free;
+
+	if (out->free_bytes != 0)
+		out->fragmentation = 1.0 - (double)out->largest_free_region / out->free_bytes;
+}
+
+void sf_heap_stats(struct sf_heap *h, struct sf_stats *out)
+{
+	struct sf_heap *saved = heap;
+	heap = h;
+	sf_stats(out);
+	heap = saved;
+}
+
+/**
+ * Bytes of the regions in the free list of the current heap. Regions tile
+ * the heap between prologue and epilogue, so this is whatever is not
+ * allocated, fenced off, or freed to a fast bin or the pending list.
+ */
+static size_t free_list_bytes()
+{
+	size_t regions = (char*)heap->epilogue_header - NEXT_WORD(heap->prologue_footer);
+	size_t free_bytes = regions - heap->allocated_bytes - heap->fence_bytes - heap->fast_bin_bytes;
+	#ifdef DEFERRED
+		free_bytes -= heap->pending_bytes;
+	#endif
+	return free_bytes;
+}
+
+void* sf_malloc_tagged(size_t size, int tag)
+{
+	if (tag <= 0 || tag >= SF_MAX_TAGS)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void* ptr = sf_malloc(size);
+	if (ptr == NULL)
+		return NULL;
+
+	tag_region(ptr, tag);
+	heap->tags[tag].allocations++;
+	return ptr;
+}
+
+int sf_tag_stats(int tag, struct sf_tag_stats *out)
+{
+	if (tag <= 0 || tag >= SF_MAX_TAGS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	*out = heap->tags[tag];
+	return 0;
+}
+
+int sf_heap_tag_stats(struct sf_heap *h, int tag, struct sf_tag_stats *out)
+{
+	struct sf_heap *saved = heap;
+	heap = h;
+	int result = sf_tag_stats(tag, out);
+	heap = saved;
+	return result;
+}
+
+long sf_reserve(size_t bytes, int flags)
+{
+	errno = 0;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (bytes == 0)
+		return 0;
+
+	if (bytes > MAX)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// A free region already at the top of the heap counts towards the reservation.
+	size_t top_free = 0;
+	char* top_footer = PREV_WORD(heap->epilogue_header);
+	if (GET_ALLOC(top_footer) == FREE)
+		top_free = GET_REGION_SIZE(top_footer);
+
+	if (top_free < bytes && extend_heap(ALIGN_UP(bytes - top_free, FOUR_KB)) == NULL)
+		return -1;
+
+	// extend_heap coalesced everything into one region ending at the epilogue.
+	char* heap_top = NEXT_WORD(heap->epilogue_header);
+	char* top_header = (char*)heap->epilogue_header - GET_REGION_SIZE(PREV_WORD(heap->epilogue_header));
+
+	if (heap_top > heap->reserve_floor)
+		heap->reserve_floor = heap_top;
+
+	#ifdef DEBUG
+		printf("reserved %lu bytes at %p\n", (size_t)(heap_top - top_header), top_header);
+	#endif
+
+	if (flags & SF_RESERVE_PREFAULT)
+		prefault((char*)ALIGN_DOWN(top_header, FOUR_KB), heap_top, flags & SF_RESERVE_PARALLEL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+int sf_set_limit(size_t soft, size_t hard)
+{
+	if (soft != 0 && hard != 0 && soft > hard)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	soft_limit = soft;
+	hard_limit = hard;
+	return 0;
+}
+
+int sf_register_pressure_callback(sf_pressure_callback callback, void *arg)
+{
+	if (num_pressure_callbacks == MAX_PRESSURE_CALLBACKS)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pressure_callbacks[num_pressure_callbacks].callback = callback;
+	pressure_callbacks[num_pressure_callbacks].arg = arg;
+	num_pressure_callbacks++;
+	return 0;
+}
+
+int sf_unregister_pressure_callback(sf_pressure_callback callback, void *arg)
+{
+	int i;
+	for (i = 0; i < num_pressure_callbacks; i++)
+	{
+		if (pressure_callbacks[i].callback == callback && pressure_callbacks[i].arg == arg)
+		{
+			num_pressure_callbacks--;
+			pressure_callbacks[i] = pressure_callbacks[num_pressure_callbacks];
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+int sf_mallopt(int param, size_t value)
+{
+	switch (param)
+	{
+		case SF_LARGE_THRESHOLD:
+			if (value < MIN_REGION_SIZE)
+				return 0;
+			large_threshold = value;
+			return 1;
+
+		case SF_SAMPLE_RATE:
+			if (value > 0 && sample_table == NULL)
+			{
+				sample_table = mmap(NULL, SAMPLE_TABLE_SIZE * sizeof(struct sf_sample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (sample_table == MAP_FAILED)
+				{
+					sample_table = NULL;
+					return 0;
+				}
+
+				// The first backtrace loads libgcc, which allocates. Get that
+				// over with now rather than in the middle of an allocation.
+				void* stack[1];
+				backtrace(stack, 1);
+
+				sample_seed = (int64)time(NULL) ^ (int64)(uintptr_t)sample_table;
+			}
+
+			sample_rate = value;
+			bytes_until_sample = value > 0 ? next_sample_interval() : SIZE_MAX;
+			return 1;
+
+		case SF_SIZE_CLASSES:
+			if (value > 1)
+				return 0;
+			use_size_classes = value;
+			return 1;
+
+		case SF_FAST_BINS:
+		{
+			if (value > FAST_BIN_MAX)
+				return 0;
+
+			// Regions binned under the old size would be stranded.
+			fast_bin_size = value > 0 ? REGION_SIZE(value) : 0;
+			struct sf_heap *saved = heap;
+			for (heap = &default_heap; heap != NULL; heap = heap->next)
+			{
+				if (heap->fast_bin_regions > 0)
+					consolidate_fast_bins();
+			}
+			heap = saved;
+			return 1;
+		}
+
+		case SF_POLICY:
+		{
+			if ((value & ~SF_POLICY_MASK) || (value & SF_POLICY_NEXT && value & SF_POLICY_BEST))
+				return 0;
+
+			// Heaps not set up yet get it from init_heap.
+			default_policy = value;
+			struct sf_heap *saved = heap;
+			for (heap = &default_heap; heap != NULL; heap = heap->next)
+			{
+				if (heap->heap_start != NULL)
+					set_policy(value);
+			}
+			heap = saved;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void sf_snapshot()
+{
+	// Make sure user requested for heap space.
+	if (heap->freelist_pointer != NULL)
+	{
+		printf("Explicit 8 %lu\n\n", heap->heap_size);
+		/*
+			08/23/12 - 12:40AM		# use strftime
+			0x00095040 8
+			0x0010a058 16
+		 */
+		
+		char buffer[256];	
+  		time_t curtime;
+  		struct tm *loctime;
+
+		/* Get the current time. */
+		curtime = time(NULL);
+
+		/* Convert it to local time representation. */
+		loctime = localtime (&curtime);
+
+   		strftime (buffer, 256, "# %m/%d/%y - %I:%M%p\n", loctime);
+		printf("%s\n", buffer);
+
+		void* ptr = heap->freelist_pointer; // head of first free region
+		printf("%p %lu\n", ptr, GET_REGION_SIZE(ptr));
+		ptr = (void*)GET(FORWARD_LINK(ptr));
+
+		while (ptr != heap->freelist_pointer)
+		{
+			printf("%p %lu\n", ptr, GET_REGION_SIZE(ptr));
+			ptr = (void*)GET(FORWARD_LINK(ptr));
+		}
+
+	}
+}
+
+/**
+ * Print information about heap when debugging.
+ */
+void print_heap_stats()
+{
+	printf("\nCURRENT HEAP STATS\n");
+	printf("heap_start: %p\n", heap->heap_start);
+	printf("prologue_header: %p - %lu\n", heap->prologue_header, GET(heap->prologue_header));
+	printf("prologue_footer: %p - %lu\n", heap->prologue_footer, GET(heap->prologue_footer));
+	printf("epilogue_header: %p - %lu\n", heap->epilogue_header, GET(heap->epilogue_header));
+	printf("heap_size: %lu\n", heap->heap_size);
+	printf("freelist_pointer: %p\n", heap->freelist_pointer);
+	printf("large objects: %lu bytes mapped\n", heap->large_bytes);
+	printf("policy: %d\n", heap->policy);
+	printf("next_free_pointer: %p\n", heap->next_free_pointer);
+}
+
+/**
+ * Increases heap by size if there is enough memory.
+ * With HUGEPAGE, size is rounded up so the top of the heap always lands on a
+ * 2 MB boundary, and the new memory is advised to be backed by transparent huge pages.
+ * @return the pointer to the now newly acquired free region
+ */
+static void *extend_heap(size_t size)
+{
+	// This may run callbacks that free regions and trim the heap, so it has to
+	// come before we look at the top of the heap.
+	if (!within_limits(size))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	char* old_epilogue = (char*)heap->epilogue_header;
+	char* heap_top = NEXT_WORD(old_epilogue);
+	char* brk_top = (char*)heap_sbrk(0);
+
+	if (brk_top < heap_top)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Someone else (usually the C library's own malloc) may have moved the break since
+	// we last grew. Cover the foreign memory with an allocated fence region so the
+	// heap stays one walkable sequence of regions.
+	size_t fence_size = 0;
+	if (brk_top != heap_top)
+		fence_size = ALIGN_UP(brk_top - old_epilogue + WSIZE, DSIZE);
+
+	#ifdef HUGEPAGE
+		char* region_start = old_epilogue + fence_size;
+		size = ALIGN_UP(region_start + size + WSIZE, TWO_MB) - (uintptr_t)(region_start + WSIZE);
+	#endif
+
+	size_t inc = (old_epilogue + fence_size + size + WSIZE) - brk_top;
+
+	if (heap->heap_size + inc > MAX || fence_size > MAX ||
+		(hard_limit != 0 && footprint() + inc > hard_limit))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	if (heap_sbrk(inc) == (void*)-1)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	heap->heap_size += inc;
+	heap->extend_calls++;
+	heap->extend_bytes += inc;
+	heap->fence_bytes += fence_size;
+
+	if (fence_size != 0)
+	{
+		#ifdef DEBUG
+			printf("break moved by someone else. fencing %lu bytes at %p\n", fence_size, old_epilogue);
+		#endif
+		PUT(old_epilogue, PACK(0, fence_size, ALLOCATED));
+		PUT(old_epilogue + fence_size - WSIZE, PACK(0, fence_size, ALLOCATED));
+	}
+
+	int64* rp = (int64*)NEXT_WORD(old_epilogue + fence_size);
+	
+	#ifdef DEBUG
+		printf("extending heap size to: %lu\n", heap->heap_size);
+		printf("previous top of heap: %p\n", brk_top);
+		printf("new top of heap: %p\n", heap_sbrk(0));
+	#endif
+
+	#ifdef HUGEPAGE
+		// Ask for transparent huge pages on everything we just got. The advice only
+		// sticks to whole 2 MB pages, which is why the top is kept 2 MB aligned.
+		char* advise_start = (char*)ALIGN_DOWN(brk_top, FOUR_KB);
+		madvise(advise_start, (char*)heap_sbrk(0) - advise_start, MADV_HUGEPAGE);
+	#endif
+
+	// Pages past the old break come zeroed from the kernel. The rest of the page
+	// the break was in may not be, so clear it to be able to mark the region zero.
+	char* page_end = (char*)ALIGN_UP(brk_top, FOUR_KB);
+	if ((char*)rp < page_end)
+		memset(rp, 0, page_end - (char*)rp);
+
+	// The fence is someone else's memory.
+	if (fence_size != 0)
+		heap->zero_floor = HEADER_ADDRESS(rp);
+
+	// Initialize the free block header/footer of the free region
+	PUT(HEADER_ADDRESS(rp), PACK(0, size, FREE | ZERO)); 
+	PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE | ZERO));	
+
+	// New epilogue header
+	heap->epilogue_header = (int64*)NEXT_HEADER_ADDRESS(rp);
+	PUT(heap->epilogue_header, PACK(0, 0, ALLOCATED));
+
+	// Coalesce if the previous block was free
+	return coalesce(rp);
+}
+
+/**
+ * sbrk for the current heap. The default heap moves the real break, other
+ * heaps move a break inside their reserved mapping. Memory given back there
+ * is dropped, so it reads as zero when the heap grows again, like fresh sbrk memory.
+ * @return The previous break, or (void*)-1 with ERRNO set to ENOMEM.
+ */
+static void *heap_sbrk(intptr_t inc)
+{
+	if (heap->brk == NULL)
+		return sbrk(inc);
+
+	char* old_brk = heap->brk;
+	if (inc > heap->brk_limit - old_brk || old_brk + inc < (char*)heap->heap_start)
+	{
+		errno = ENOMEM;
+		return (void*)-1;
+	}
+
+	if (inc < 0)
+	{
+		char* release_start = (char*)ALIGN_UP(old_brk + inc, FOUR_KB);
+		if (release_start < old_brk)
+			madvise(release_start, old_brk - release_start, MADV_DONTNEED);
+	}
+
+	heap->brk += inc;
+	return old_brk;
+}
+
+/**
+ * Gives the top of the heap back to the system once the free region right
+ * before the epilogue is larger than TRIM_THRESHOLD. TRIM_KEEP bytes of it are kept
+ * so the next small malloc does not have to extend the heap right away.
+ * With HUGEPAGE, memory is only given back in whole huge pages so the huge page
+ * the heap is still using is never split.
+ * @param under_pressure Ignore TRIM_THRESHOLD and sf_reserve reservations and
+ * give back everything we can.
+ */
+static void trim_heap(bool under_pressure)
+{
+	char* top_footer = PREV_WORD(heap->epilogue_header);
+	if (GET_ALLOC(top_footer) != FREE)
+		return;
+
+	size_t top_size = GET_REGION_SIZE(top_footer);
+	if (top_size < TRIM_THRESHOLD && !under_pressure)
+		return;
+
+	if (under_pressure)
+		heap->reserve_floor = NULL;
+
+	// We can only shrink the break if nobody has moved it past us.
+	char* heap_top = NEXT_WORD(heap->epilogue_header);
+	if ((char*)heap_sbrk(0) != heap_top)
+		return;
+
+	char* top_header = (char*)heap->epilogue_header - top_size;
+
+	#ifdef HUGEPAGE
+		size_t granularity = TWO_MB;
+	#else
+		size_t granularity = FOUR_KB;
+	#endif
+
+	char* new_top = (char*)ALIGN_UP(top_header + TRIM_KEEP + WSIZE, granularity);
+	if (new_top < heap->reserve_floor)
+		new_top = (char*)ALIGN_UP(heap->reserve_floor, granularity);
+	if (new_top >= heap_top || (heap_top - new_top < TRIM_THRESHOLD && !under_pressure))
+		return;
+
+	size_t release = heap_top - new_top;
+
+	#ifdef DEBUG
+		printf("trimming %lu bytes from the top of the heap\n", release);
+	#endif
+
+	// The region keeps its place in the free list, only its size changes.
+	size_t new_size = top_size - release;
+	largest_free_removed(top_size);
+	largest_free_added(new_size);
+	int64 zero = GET_ZERO(top_header);
+	PUT(top_header, PACK(0, new_size, FREE | zero));
+	PUT(top_header + new_size - WSIZE, PACK(0, new_size, FREE | zero));
+
+	heap->epilogue_header = (int64*)(top_header + new_size);
+	PUT(heap->epilogue_header, PACK(0, 0, ALLOCATED));
+
+	// The pages given back come back zero if the heap grows again.
+	if (heap->zero_floor > (char*)heap->epilogue_header)
+		heap->zero_floor = (char*)heap->epilogue_header;
+
+	heap_sbrk(-release);
+	heap->heap_size -= release;
+
+	#ifdef HUGEPAGE
+		if (heap->touched_top > new_top)
+			heap->touched_top = new_top;
+	#endif
+}
+
+/**
+ * Find a free region that fits the size.
+ * This function uses a explicit freelist using first-fit, next-fit or
+ * best-fit depending on the heap's policy.
+ */
+static void *find_fit(size_t size)
+{
+	heap->find_fit_calls++;
+
+	if ((heap->policy & SF_POLICY_AUTO) && heap->find_fit_calls - heap->tuned_calls >= AUTO_POLICY_INTERVAL)
+		tune_policy();
+
+	// This is the case where there are no free regions.
+	if (heap->freelist_pointer == NULL)
+	{
+		#ifdef DEBUG
+			printf("No free regions. We must extend the heap.\n");
+		#endif
+		return NULL;
+	}
+
+	#ifdef HUGEPAGE
+		// Fill the huge pages we already touched before faulting in new ones.
+		void* touched_fit = find_fit_in_touched_pages(size);
+		if (touched_fit != NULL)
+			return touched_fit;
+	#endif
+
+	// One copy of the search per placement, each with the others' branches
+	// folded away. The policy is looked at once here, not once per probe.
+	void* rp;
+	switch (heap->policy & (SF_POLICY_NEXT | SF_POLICY_BEST))
+	{
+		case SF_POLICY_NEXT:
+			rp = search_free_list(heap->next_free_pointer, size, SF_POLICY_NEXT);
+			break;
+		case SF_POLICY_BEST:
+			rp = search_free_list(heap->freelist_pointer, size, SF_POLICY_BEST);
+			break;
+		default:
+			rp = search_free_list(heap->freelist_pointer, size, 0);
+			break;
+	}
+
+	if (rp != NULL && GET_REGION_SIZE(HEADER_ADDRESS(rp)) > heap->tuned_largest)
+		heap->tuned_largest = GET_REGION_SIZE(HEADER_ADDRESS(rp));
+	return rp;
+}
+
+/**
+ * Go around the circular free list once from start_ptr, looking for a region
+ * of at least size bytes. First and next fit take the first one, best fit the
+ * smallest, stopping early at an exact fit. Always inlined with a constant
+ * placement, so every caller gets a search specialized for it.
+ * @param placement 0 for first fit, SF_POLICY_NEXT or SF_POLICY_BEST.
+ * @return the payload of the region, or NULL if there is none.
+ */
+static inline void *search_free_list(int64 *start_ptr, size_t size, int placement)
+{
+	int64* fp = start_ptr;
+	int64* best = NULL;
+	do
+	{
+		size_t region_size = GET_REGION_SIZE(fp);
+		heap->find_fit_probes++;
+
+		#ifdef DEBUG
+			printf("Checking %p.\n", fp);
+			printf("This region has a size of %lu.\n", region_size);
+		#endif
+
+		if (region_size >= size)
+		{
+			if (placement != SF_POLICY_BEST)
+			{
+				#ifdef DEBUG
+					printf("Free region found at address! - %p.\n", fp);
+				#endif
+				return NEXT_WORD(fp);
+			}
+
+			if (best == NULL || region_size < GET_REGION_SIZE(best))
+			{
+				best = fp;
+				if (region_size == size)
+					break;
+			}
+		}
+
+		fp = (int64*)GET(FORWARD_LINK(fp));
+	} while (fp != start_ptr);
+
+	#ifdef DEBUG
+		if (best == NULL)
+			printf("No free regions of size %lu.\n", size);
+	#endif
+
+	return best == NULL ? NULL : NEXT_WORD(best);
+}
+
+/**
+ * First-fit search for a free region that can hold a region of size bytes
+ * with its payload at a multiple of alignment.
+ * @return the header of the free region, or NULL if there is none.
+ */
+static void *find_fit_aligned(size_t size, size_t alignment)
+{
+	if (heap->freelist_pointer == NULL)
+		return NULL;
+
+	void* fp = heap->freelist_pointer;
+	do
+	{
+		if (aligned_payload(fp, size, alignment) != NULL)
+			return fp;
+		fp = (void*)GET(FORWARD_LINK(fp));
+	} while (fp != heap->freelist_pointer);
+
+	return NULL;
+}
+
+/**
+ * Find the first payload address in the free region hp that is a multiple of
+ * alignment and leaves either no gap in front of it or a gap big enough to be
+ * a free region of its own.
+ * @return the payload address, or NULL if size bytes do not fit after it.
+ */
+static void *aligned_payload(void *hp, size_t size, size_t alignment)
+{
+	char* payload = NEXT_WORD(hp);
+	char* aligned = (char*)ALIGN_UP(payload, alignment);
+
+	if (aligned != payload && aligned - payload < MIN_REGION_SIZE)
+		aligned = (char*)ALIGN_UP(payload + MIN_REGION_SIZE, alignment);
+
+	if (HEADER_ADDRESS(aligned) + size > (char*)hp + GET_REGION_SIZE(hp))
+		return NULL;
+
+	return aligned;
+}
+
+/**
+ * Place an aligned region with payload ptr inside the free region hp.
+ * The gap in front of it stays in the free list as a smaller free region, and
+ * the rest goes through place like any other fit.
+ */
+static void place_aligned(void *hp, void *ptr, size_t adjusted_size, size_t requested_size)
+{
+	size_t gap = (char*)HEADER_ADDRESS(ptr) - (char*)hp;
+
+	if (gap != 0)
+	{
+		size_t region_size = GET_REGION_SIZE(hp);
+		int64 zero = GET_ZERO(hp);
+
+		#ifdef DEBUG
+			printf("Splitting off %lu bytes in front of aligned region %p.\n", gap, ptr);
+		#endif
+
+		// The gap keeps the free region's place in the free list.
+		largest_free_removed(region_size);
+		largest_free_added(gap);
+		PUT(hp, PACK(0, gap, FREE | zero));
+		PUT((char*)hp + gap - WSIZE, PACK(0, gap, FREE | zero));
+
+		PUT(HEADER_ADDRESS(ptr), PACK(0, region_size - gap, FREE | zero));
+		PUT(FOOTER_ADDRESS(ptr), PACK(0, region_size - gap, FREE | zero));
+
+		// Right after the gap, so address order is kept.
+		freelist_insert_after(hp, HEADER_ADDRESS(ptr));
+	}
+
+	place(ptr, adjusted_size, requested_size);
+}
+
+/**
+ * Place the requested region at the beginning of the free region, splitting
+ * only if the size of the remainder would equal or exceed the minimum block size.
+ * ptr MUST be a free region.
+ */
+static void place(void *ptr, size_t adjusted_size, size_t requested_size)
+{
+	if (GET_ALLOC(ptr) != FREE)
+	{
+		#ifdef DEBUG
+			printf("ERROR. CALLING place() ON ALREADY ALLOCATED REGION!\n\n");
+		#endif
+		return;
+	}
+
+	int64* rp = (int64*)ptr;
+
+	int64 free_region_size = GET_REGION_SIZE(HEADER_ADDRESS(rp)); // size of the current free region
+	int64 zero = GET_ZERO(HEADER_ADDRESS(rp));
 
 	if (free_region_size < adjusted_size)
 	{
-		#ifdef DEBUG
-			printf("ERROR. CALLING place() ON REGION THAT IS TOO SMALL - %lu bytes\n\n", free_region_size);
-		#endif
+		#ifdef DEBUG
+			printf("ERROR. CALLING place() ON REGION THAT IS TOO SMALL - %lu bytes\n\n", free_region_size);
+		#endif
+		return;
+	}
+
+	if (free_region_size > adjusted_size + (2 * WSIZE))
+	{
+		// split
+		// ex:
+		// size = 32, free_region_size = 48
+		/*
+		 __H_ ____ ____ ____ ____ __F_
+		|    |    |    |    |    |    |
+		| 48 | rp |    |    |    | 48 |
+		 ---- ---- ---- ---- ---- ----
+		 Free                     Free
+
+		 convert to
+
+		 __H_ ____ ____ __F_ __H_ __F_
+		|    |    |    |    |    |    |
+		| 32 | rp |    | 32 | 16 | 16 |
+		 ---- ---- ---- ---- ---- ----
+		 Allo     		Allo Free Free
+
+		DO NOT split in cases like this b/c we have no space for forward and back links.
+		 */
+
+		int64 split_size = free_region_size - adjusted_size;
+
+		#ifdef DEBUG
+			printf("Splitting region into two of size %lu and %lu.\n\n", adjusted_size, split_size);
+		#endif
+
+		// Our allocated region
+		PUT(HEADER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+		PUT(FOOTER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+
+		void* split_head = NEXT_HEADER_ADDRESS(rp);
+		// split region
+		PUT(split_head, PACK(0, split_size, FREE | zero));
+		PUT(FOOTER_ADDRESS(NEXT_WORD(split_head)), PACK(0, split_size, FREE | zero));
+
+		// The split region takes over our place in the free list.
+		largest_free_removed(free_region_size);
+		freelist_replace(HEADER_ADDRESS(rp), split_head);
+	} 
+	else
+	{
+		if (free_region_size > adjusted_size)
+		{
+			// If we chose not to split because the resulting region would be too small,
+			// we must include the size in the adjusted size.
+			adjusted_size = adjusted_size + (2 * WSIZE);
+		}
+
+		freelist_remove(HEADER_ADDRESS(rp));
+
+		PUT(HEADER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+		PUT(FOOTER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+	}
+
+	heap->allocated_bytes += adjusted_size;
+	heap->requested_bytes += requested_size;
+
+	// Only what lies under the zero floor can be dirty. From now on the
+	// caller may write anywhere in the region.
+	char* dirty_end = heap->zero_floor < (char*)rp ? (char*)rp : heap->zero_floor;
+	placed_dirty_end = zero ? (char*)rp : dirty_end < (char*)FOOTER_ADDRESS(rp) ? dirty_end : (char*)FOOTER_ADDRESS(rp);
+	if (NEXT_HEADER_ADDRESS(rp) > heap->zero_floor)
+		heap->zero_floor = NEXT_HEADER_ADDRESS(rp);
+
+	#ifdef HUGEPAGE
+		if (NEXT_HEADER_ADDRESS(rp) > heap->touched_top)
+			heap->touched_top = NEXT_HEADER_ADDRESS(rp);
+	#endif
+}
+
+/**
+ * Help function with four cases. 
+ * CASE 1: next and prev are allocated
+ * CASE 2: next is free, prev is allocated
+ * CASE 3: prev is free, prev is allocated
+ * CASE 4: next and prev are free
+ *
+ * One subtle aspect: The prologue and epilogue allow us to ignore the potentially
+ * troublesome edge conditions where the requested block bp is at the beginning
+ * or end of the heap. Without these special blocks, the code would be messier,
+ * more error prone, and slower.
+ * 
+ */
+static void *coalesce(void *ptr)
+{
+	int64* rp = (int64*)ptr;
+
+	size_t is_prev_alloc = GET_ALLOC(PREV_FOOTER_ADDRESS(rp));
+	size_t is_next_alloc = GET_ALLOC(NEXT_HEADER_ADDRESS(rp));
+	size_t size = GET_REGION_SIZE(HEADER_ADDRESS(rp));
+
+	void* next_header = NEXT_HEADER_ADDRESS(rp);
+	void* prev_header = PREV_HEADER_ADDRESS(rp);
+
+	// CASE 1
+	if (is_prev_alloc && is_next_alloc)
+	{
+		#ifdef DEBUG
+			printf("coalescing case 1\n");
+		#endif
+		heap->coalesce_cases[0]++;
+		/*
+		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
+		|    |    |    |    |    |    |	   |    |    |    |    |    |
+		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
+		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+		 				allo free           free allo
+
+ 		*/
+	}
+
+	// CASE 2
+	else if (is_prev_alloc && !is_next_alloc)
+	{
+		#ifdef DEBUG
+			printf("coalescing case 2\n");
+		#endif
+		heap->coalesce_cases[1]++;
+		/*
+		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
+		|    |    |    |    |    |    |	   |    |    |    |    |    |
+		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
+		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+		 				allo free           free free
+
+ 		*/
+		freelist_remove(next_header);
+
+		// The merged region is only zero if both halves are and the tags between them are cleared.
+		int64 zero = GET_ZERO(HEADER_ADDRESS(rp)) & GET_ZERO(next_header);
+
+		size += GET_REGION_SIZE(next_header);
+		if (zero)
+			clear_boundary(next_header);
+		else
+			clear_tags_above_floor(next_header);
+		PUT(HEADER_ADDRESS(rp), PACK(0, size, FREE | zero));
+		PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE | zero));
+	}
+	
+	// CASE 3
+	else if (!is_prev_alloc && is_next_alloc)
+	{
+		#ifdef DEBUG
+			printf("coalescing case 3\n");
+		#endif
+		heap->coalesce_cases[2]++;
+		/*
+		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
+		|    |    |    |    |    |    |	   |    |    |    |    |    |
+		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
+		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+		 				free free           free allo
+
+ 		*/
+		freelist_remove(prev_header);
+
+		int64 zero = GET_ZERO(prev_header) & GET_ZERO(HEADER_ADDRESS(rp));
+
+		size += GET_REGION_SIZE(PREV_FOOTER_ADDRESS(rp));
+		PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE | zero));
+		if (zero)
+			clear_boundary(HEADER_ADDRESS(rp));
+		else
+			clear_tags_above_floor(HEADER_ADDRESS(rp));
+		PUT(prev_header, PACK(0, size, FREE | zero));
+		rp = (int64*)NEXT_WORD(prev_header);
+	}
+
+	// CASE 4
+	else
+	{
+		#ifdef DEBUG
+			printf("coalescing case 4\n");
+		#endif
+		heap->coalesce_cases[3]++;
+		/*
+		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
+		|    |    |    |    |    |    |	   |    |    |    |    |    |
+		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
+		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
+		 				free free           free free
+
+ 		*/
+		freelist_remove(next_header);
+		freelist_remove(prev_header);
+
+		int64 zero = GET_ZERO(prev_header) & GET_ZERO(HEADER_ADDRESS(rp)) & GET_ZERO(next_header);
+
+		size += GET_REGION_SIZE(PREV_FOOTER_ADDRESS(rp)) + GET_REGION_SIZE(next_header);
+		PUT(FOOTER_ADDRESS(NEXT_WORD(next_header)), PACK(0, size, FREE | zero));
+		if (zero)
+		{
+			clear_boundary(next_header);
+			clear_boundary(HEADER_ADDRESS(rp));
+		}
+		else
+		{
+			clear_tags_above_floor(next_header);
+			clear_tags_above_floor(HEADER_ADDRESS(rp));
+		}
+		PUT(prev_header, PACK(0, size, FREE | zero));
+		rp = (int64*)NEXT_WORD(prev_header);
+	}
+
+	freelist_insert(HEADER_ADDRESS(rp));
+
+	return rp;
+}
+
+/**
+ * Clear the tags a merge leaves inside a region that is not known-zero, if
+ * any of them reach above the zero floor. Only the top free region has tags
+ * up there.
+ */
+static void clear_tags_above_floor(void *hp)
+{
+	if ((char*)hp + 3 * WSIZE > heap->zero_floor)
+		clear_boundary(hp);
+}
+
+/**
+ * Zero the tags between two free regions being merged: the footer in front of
+ * hp, the header hp and its links. Keeps the merged region known-zero.
+ */
+static void clear_boundary(void *hp)
+{
+	PUT(PREV_WORD(hp), 0x0);
+	PUT(hp, 0x0);
+	PUT(FORWARD_LINK(hp), 0x0);
+	PUT(BACK_LINK(hp), 0x0);
+}
+
+/**
+ * Zero size bytes at ptr, both multiples of DSIZE as every payload is.
+ * Uses 16 byte vector stores, and non-temporal ones from NT_ZERO_THRESHOLD up
+ * so a big calloc does not evict everything else from the cache.
+ */
+static void zero_payload(void *ptr, size_t size)
+{
+	#ifdef __SSE2__
+		__m128i zero = _mm_setzero_si128();
+		__m128i* v = (__m128i*)ptr;
+		__m128i* end = (__m128i*)((char*)ptr + size);
+
+		if (size >= NT_ZERO_THRESHOLD)
+		{
+			for (; v + 4 <= end; v += 4)
+			{
+				_mm_stream_si128(v, zero);
+				_mm_stream_si128(v + 1, zero);
+				_mm_stream_si128(v + 2, zero);
+				_mm_stream_si128(v + 3, zero);
+			}
+			for (; v < end; v++)
+				_mm_stream_si128(v, zero);
+			_mm_sfence();
+			return;
+		}
+
+		for (; v + 4 <= end; v += 4)
+		{
+			_mm_store_si128(v, zero);
+			_mm_store_si128(v + 1, zero);
+			_mm_store_si128(v + 2, zero);
+			_mm_store_si128(v + 3, zero);
+		}
+		for (; v < end; v++)
+			_mm_store_si128(v, zero);
+	#else
+		memset(ptr, 0, size);
+	#endif
+}
+
+/**
+ * Insert the free region with header hp at the front of the free list, or
+ * at its place in address order with SF_POLICY_ADDRESS.
+ */
+static void freelist_insert(void *hp)
+{
+	if (heap->freelist_pointer == NULL)
+	{
+		// circular link to indicate only 1 free region at the moment
+		PUT(FORWARD_LINK(hp), (int64)hp);
+		PUT(BACK_LINK(hp), (int64)hp);
+		heap->freelist_pointer = (int64*)hp;
+	}
+	else
+	{
+		void* after = heap->freelist_pointer;
+		void* before = (void*)GET(BACK_LINK(after));
+
+		if (heap->policy & SF_POLICY_ADDRESS)
+		{
+			// Look for hp's place from two sides at once: through the regions
+			// after it for the next free one, and down the list from the
+			// highest free region for the one below it. A long run of allocated
+			// regions or a long free list only slows down one of them.
+			char* next = (char*)hp + GET_REGION_SIZE(hp);
+			void* below = before;
+			while (next != (char*)heap->epilogue_header)
+			{
+				if (GET_ALLOC(next) == FREE)
+				{
+					after = next;
+					before = (void*)GET(BACK_LINK(after));
+					break;
+				}
+				if ((char*)below < (char*)hp)
+				{
+					before = below;
+					after = (void*)GET(FORWARD_LINK(before));
+					break;
+				}
+				if (below == heap->freelist_pointer)
+					break;	// hp is the lowest, so it goes in front of the head
+
+				next += GET_REGION_SIZE(next);
+				below = (void*)GET(BACK_LINK(below));
+			}
+		}
+
+		PUT(FORWARD_LINK(hp), (int64)after);
+		PUT(BACK_LINK(hp), (int64)before);
+		PUT(FORWARD_LINK(before), (int64)hp);
+		PUT(BACK_LINK(after), (int64)hp);
+
+		if (!(heap->policy & SF_POLICY_ADDRESS) || (char*)hp < (char*)heap->freelist_pointer)
+			heap->freelist_pointer = (int64*)hp;
+	}
+
+	heap->free_regions++;
+	largest_free_added(GET_REGION_SIZE(hp));
+
+	if (heap->next_free_pointer == NULL)
+		heap->next_free_pointer = heap->freelist_pointer;
+}
+
+/**
+ * Unlink the free region with header hp from the free list.
+ */
+static void freelist_remove(void *hp)
+{
+	void* after = (void*)GET(FORWARD_LINK(hp));
+	void* before = (void*)GET(BACK_LINK(hp));
+
+	heap->free_regions--;
+	largest_free_removed(GET_REGION_SIZE(hp));
+
+	if (after == hp)
+	{
+		// hp was the only free region
+		heap->freelist_pointer = NULL;
+		heap->next_free_pointer = NULL;
 		return;
 	}
 
-	if (free_region_size > adjusted_size + (2 * WSIZE))
+	PUT(FORWARD_LINK(before), (int64)after);
+	PUT(BACK_LINK(after), (int64)before);
+
+	if (heap->freelist_pointer == (int64*)hp)
+		heap->freelist_pointer = (int64*)after;
+
+	// if the next-fit pointer is taken out of the list, move it along.
+	if (heap->next_free_pointer == (int64*)hp)
+		heap->next_free_pointer = (int64*)after;
+}
+
+/**
+ * Put the free region new_hp in the free list position of old_hp.
+ * Used when splitting, so the remainder keeps the place of the region it came from.
+ * old_hp's header may already be overwritten, so the caller accounts for its size.
+ */
+static void freelist_replace(void *old_hp, void *new_hp)
+{
+	void* after = (void*)GET(FORWARD_LINK(old_hp));
+	void* before = (void*)GET(BACK_LINK(old_hp));
+
+	if (after == old_hp)
 	{
-		// split
-		// ex:
-		// size = 32, free_region_size = 48
-		/*
-		 __H_ ____ ____ ____ ____ __F_
-		|    |    |    |    |    |    |
-		| 48 | rp |    |    |    | 48 |
-		 ---- ---- ---- ---- ---- ----
-		 Free                     Free
+		after = new_hp;
+		before = new_hp;
+	}
 
-		 convert to
+	PUT(FORWARD_LINK(new_hp), (int64)after);
+	PUT(BACK_LINK(new_hp), (int64)before);
+	PUT(FORWARD_LINK(before), (int64)new_hp);
+	PUT(BACK_LINK(after), (int64)new_hp);
 
-		 __H_ ____ ____ __F_ __H_ __F_
-		|    |    |    |    |    |    |
-		| 32 | rp |    | 32 | 16 | 16 |
-		 ---- ---- ---- ---- ---- ----
-		 Allo     		Allo Free Free
+	if (heap->freelist_pointer == (int64*)old_hp)
+		heap->freelist_pointer = (int64*)new_hp;
 
-		DO NOT split in cases like this b/c we have no space for forward and back links.
-		 */
+	if (heap->next_free_pointer == (int64*)old_hp)
+		heap->next_free_pointer = (int64*)new_hp;
 
-		int64 split_size = free_region_size - adjusted_size;
+	largest_free_added(GET_REGION_SIZE(new_hp));
+}
 
-		#ifdef DEBUG
-			printf("Splitting region into two of size %lu and %lu.\n\n", adjusted_size, split_size);
-		#endif
+/**
+ * Link the free region hp into the free list right after prev_hp.
+ */
+static void freelist_insert_after(void *prev_hp, void *hp)
+{
+	void* after = (void*)GET(FORWARD_LINK(prev_hp));
 
-		// Our allocated region
-		PUT(HEADER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
-		PUT(FOOTER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+	PUT(FORWARD_LINK(hp), (int64)after);
+	PUT(BACK_LINK(hp), (int64)prev_hp);
+	PUT(FORWARD_LINK(prev_hp), (int64)hp);
+	PUT(BACK_LINK(after), (int64)hp);
 
-		void* split_head = NEXT_HEADER_ADDRESS(rp);
-		// split region
-		PUT(split_head, PACK(0, split_size, FREE));
-		PUT(FOOTER_ADDRESS(NEXT_WORD(split_head)), PACK(0, split_size, FREE));
+	heap->free_regions++;
+	largest_free_added(GET_REGION_SIZE(hp));
+}
+
+/**
+ * heap->largest_free is never below the largest region in the free list.
+ * A region that reaches it is the largest, so the bound is exact again.
+ */
+static void largest_free_added(size_t size)
+{
+	if (size >= heap->largest_free)
+	{
+		heap->largest_free = size;
+		heap->largest_free_dirty = false;
+	}
+}
 
-		if (GET_ALLOC(freelist_pointer) == ALLOCATED )
-			freelist_pointer = (int64*)GET(FORWARD_LINK(freelist_pointer));
+/**
+ * Taking out a region as large as the bound may leave it too high: sf_stats
+ * walks the free list for the real one next time.
+ */
+static void largest_free_removed(size_t size)
+{
+	if (size >= heap->largest_free)
+		heap->largest_free_dirty = true;
+}
+
+#ifdef HUGEPAGE
+
+/**
+ * First-fit search limited to free regions that end inside huge pages
+ * we have already touched.
+ * @return the region pointer, or NULL if a fit would fault in a new huge page
+ */
+static void *find_fit_in_touched_pages(size_t size)
+{
+	char* limit = (char*)ALIGN_UP(heap->touched_top, TWO_MB);
+
+	void* fp = heap->freelist_pointer;
+	do
+	{
+		heap->find_fit_probes++;
+		if (GET_REGION_SIZE(fp) >= size && (char*)fp + size <= limit)
+			return NEXT_WORD(fp);
+		fp = (void*)GET(FORWARD_LINK(fp));
+	} while (fp != heap->freelist_pointer);
+
+	return NULL;
+}
+
+#endif
 
-		// set freelist_pointer if this is the first time we are allocating memory.
-		if (GET_ALLOC(freelist_pointer) == ALLOCATED )
+int sf_heap_dump(int fd)
+{
+	struct sf_dump_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SF_DUMP_MAGIC;
+	header.version = SF_DUMP_VERSION;
+	header.heap_start = (int64)heap->heap_start;
+	header.heap_size = heap->heap_size;
+	header.large_bytes = heap->large_bytes;
+
+	if (write_all(fd, &header, sizeof(header)) != 0)
+		return -1;
+
+	if (heap->heap_start == NULL)
+		return 0;
+
+	// Batch the records on the stack. Allocating here would change what we dump.
+	struct sf_dump_record records[DUMP_BUFFER_RECORDS];
+	size_t count = 0;
+
+	char* hp = NEXT_WORD(heap->prologue_footer);
+	while (hp != (char*)heap->epilogue_header)
+	{
+		records[count].offset = hp - (char*)heap->heap_start;
+		records[count].header = GET(hp);
+		if (++count == DUMP_BUFFER_RECORDS)
 		{
-			freelist_pointer = (int64*)split_head;
+			if (write_all(fd, records, sizeof(records)) != 0)
+				return -1;
+			count = 0;
+		}
+		hp += GET_REGION_SIZE(hp);
+	}
 
-			PUT(BACK_LINK(split_head), (int64)split_head);
-			PUT(FORWARD_LINK(split_head), (int64)split_head);
+	return write_all(fd, records, count * sizeof(struct sf_dump_record));
+}
 
-			#ifdef NEXT
-				next_free_pointer = freelist_pointer;
-			#endif
+/**
+ * write() all of buf, carrying on after short writes and signals.
+ * @return 0 on success, or -1 with ERRNO set.
+ */
+static int write_all(int fd, const void *buf, size_t size)
+{
+	const char* p = buf;
+	while (size > 0)
+	{
+		ssize_t written = write(fd, p, size);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += written;
+		size -= written;
+	}
+	return 0;
+}
 
-			return;
+int sf_profile_dump(int fd)
+{
+	#ifdef DEBUG
+		printf("\nCall to profile_dump() - %lu samples\n", sample_count);
+	#endif
+
+	size_t total_count = 0, total_bytes = 0;
+	for (size_t i = 0; i < SAMPLE_TABLE_SIZE && sample_table != NULL; i++)
+	{
+		if (sample_table[i].ptr != NULL)
+		{
+			total_count++;
+			total_bytes += sample_table[i].size;
 		}
+	}
 
-		// Take care of forward and back links.
-		void* split_forward_link = FORWARD_LINK(split_head);
-		void* split_back_link = BACK_LINK(split_head);
+	// pprof reads the rate after heap_v2 to scale the samples back up to
+	// every allocation. We only know live allocations, so both pairs of
+	// counts are the same.
+	char line[64 + SAMPLE_MAX_DEPTH * 20];
+	int length = snprintf(line, sizeof(line), "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+		total_count, total_bytes, total_count, total_bytes, sample_rate);
+	if (write_all(fd, line, length) != 0)
+		return -1;
+
+	// One line per distinct stack. The table is small, so looking for the
+	// rest of a stack's samples with a scan is cheaper than sorting a copy.
+	bool failed = false;
+	for (size_t i = 0; i < SAMPLE_TABLE_SIZE && sample_table != NULL; i++)
+	{
+		struct sf_sample *sample = &sample_table[i];
+		if (sample->ptr == NULL || sample->dumped)
+			continue;
 
-		void* after = (void*)GET(FORWARD_LINK(HEADER_ADDRESS(rp)));
-		void* before = (void*)GET(BACK_LINK(HEADER_ADDRESS(rp)));
+		size_t count = 0, bytes = 0;
+		for (size_t j = i; j < SAMPLE_TABLE_SIZE; j++)
+		{
+			struct sf_sample *other = &sample_table[j];
+			if (other->ptr != NULL && other->stack_hash == sample->stack_hash && other->depth == sample->depth &&
+				memcmp(other->stack, sample->stack, sample->depth * sizeof(void*)) == 0)
+			{
+				other->dumped = true;
+				count++;
+				bytes += other->size;
+			}
+		}
 
+		length = snprintf(line, sizeof(line), "%lu: %lu [%lu: %lu] @", count, bytes, count, bytes);
+		for (int k = 0; k < sample->depth; k++)
+			length += snprintf(line + length, sizeof(line) - length, " %p", sample->stack[k]);
+		line[length++] = '\n';
 
-		PUT(BACK_LINK(after), (int64)split_head);
+		if (write_all(fd, line, length) != 0)
+		{
+			failed = true;
+			break;
+		}
+	}
 
-		PUT(FORWARD_LINK(before), (int64)split_head);
+	for (size_t i = 0; i < SAMPLE_TABLE_SIZE && sample_table != NULL; i++)
+		sample_table[i].dumped = false;
 
-		PUT(split_forward_link, (int64)after);
-		PUT(split_back_link, (int64)before);
+	if (failed)
+		return -1;
 
-		if (freelist_pointer == (int64*)HEADER_ADDRESS(rp))
-			freelist_pointer = (int64*)split_head;
+	// pprof needs the mappings to turn addresses into symbols.
+	const char mapped[] = "\nMAPPED_LIBRARIES:\n";
+	if (write_all(fd, mapped, sizeof(mapped) - 1) != 0)
+		return -1;
 
-		#ifdef NEXT
-			if (next_free_pointer == (int64*)HEADER_ADDRESS(rp))
-				next_free_pointer = freelist_pointer;
-		#endif
+	int maps = open("/proc/self/maps", O_RDONLY);
+	if (maps < 0)
+		return -1;
 
-		return;
-	} 
-	else if (free_region_size > adjusted_size )
+	char buffer[FOUR_KB];
+	ssize_t n;
+	while ((n = read(maps, buffer, sizeof(buffer))) != 0)
+	{
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || write_all(fd, buffer, n) != 0)
+		{
+			close(maps);
+			return -1;
+		}
+	}
+
+	close(maps);
+	return 0;
+}
+
+int sf_trace_start(int fd)
+{
+	#ifdef DEBUG
+		printf("\nCall to trace_start() - fd: %d\n", fd);
+	#endif
+
+	if (tracing)
 	{
-		// If we chose not to split because the resulting region would be too small,
-		// we must include the size in the adjusted size.
-		adjusted_size = adjusted_size + (2 * WSIZE);
+		errno = EBUSY;
+		return -1;
 	}
 
-	PUT(HEADER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
-	PUT(FOOTER_ADDRESS(rp), PACK(requested_size, adjusted_size, ALLOCATED));
+	struct sf_trace_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SF_TRACE_MAGIC;
+	header.version = SF_TRACE_VERSION;
+	header.event_size = sizeof(struct sf_trace_event);
+	if (write_all(fd, &header, sizeof(header)) != 0)
+		return -1;
+
+	// Throw away anything a thread added after the last trace stopped.
+	struct sf_trace_ring *ring;
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+	{
+		__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+		ring->dropped = 0;
+	}
 
-	// Take care of forward and back links
-	void * head = HEADER_ADDRESS(rp);
-	void* forward_link_head = FORWARD_LINK(head);
-	void* back_link_head = BACK_LINK(head);
+	trace_fd = fd;
+	trace_failed = false;
+	__atomic_store_n(&tracing, true, __ATOMIC_RELEASE);
 
-	// connect the back and forward links with each other.
-	PUT(BACK_LINK(GET(forward_link_head)), (int64)GET(back_link_head));
-	PUT(FORWARD_LINK(GET(back_link_head)), (int64)GET(forward_link_head));
+	int result = pthread_create(&trace_flusher, NULL, trace_flusher_main, NULL);
+	if (result != 0)
+	{
+		__atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+		errno = result;
+		return -1;
+	}
 
-	if (freelist_pointer == (int64*)HEADER_ADDRESS(rp))
-		freelist_pointer = (int64*)GET(forward_link_head);
+	return 0;
+}
 
-	#ifdef NEXT
-		if (next_free_pointer == (int64*)HEADER_ADDRESS(rp))
-			next_free_pointer = freelist_pointer;
+long sf_trace_stop()
+{
+	#ifdef DEBUG
+		printf("\nCall to trace_stop()\n");
 	#endif
+
+	if (!tracing)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	__atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+	pthread_join(trace_flusher, NULL);
+	flush_trace();
+
+	if (trace_failed)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	long dropped = 0;
+	struct sf_trace_ring *ring;
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	return dropped;
 }
 
 /**
- * Help function with four cases. 
- * CASE 1: next and prev are allocated
- * CASE 2: next is free, prev is allocated
- * CASE 3: prev is free, prev is allocated
- * CASE 4: next and prev are free
- *
- * One subtle aspect: The prologue and epilogue allow us to ignore the potentially
- * troublesome edge conditions where the requested block bp is at the beginning
- * or end of the heap. Without these special blocks, the code would be messier,
- * more error prone, and slower.
- * 
+ * Count size more bytes toward the next heap profile sample, and sample ptr
+ * if they run out. This is all sampling costs an unsampled allocation.
+ * @return ptr, so calls can wrap the allocation.
  */
-static void *coalesce(void *ptr)
+static void *sample_allocation(void *ptr, size_t size)
 {
-	int64* rp = (int64*)ptr;
+	if (ptr == NULL)
+		return NULL;
 
-	size_t is_prev_alloc = GET_ALLOC(PREV_FOOTER_ADDRESS(rp));
-	size_t is_next_alloc = GET_ALLOC(NEXT_HEADER_ADDRESS(rp));
-	size_t size = GET_REGION_SIZE(HEADER_ADDRESS(rp));
+	if (size < bytes_until_sample)
+		bytes_until_sample -= size;
+	else
+		record_sample(ptr, size);
 
-	void* next_header = NEXT_HEADER_ADDRESS(rp);
-	void* prev_header = PREV_HEADER_ADDRESS(rp);
+	return ptr;
+}
 
-	// CASE 1
-	if (is_prev_alloc && is_next_alloc)
+/**
+ * Add ptr to the sample table with the current call stack, and draw the
+ * distance to the next sample.
+ */
+static void record_sample(void *ptr, size_t size)
+{
+	if (sample_rate == 0)
 	{
-		#ifdef DEBUG
-			printf("coalescing case 1\n");
-		#endif
-		/*
-		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
-		|    |    |    |    |    |    |	   |    |    |    |    |    |
-		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
-		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
-		 				allo free           free allo
+		bytes_until_sample = SIZE_MAX;
+		return;
+	}
 
- 		*/
- 		// LIFO
- 		// 
- 		void* after = freelist_pointer;
- 		if (after == (int64*)HEADER_ADDRESS(rp) || after == next_header)
- 			after = (void*)GET(FORWARD_LINK(freelist_pointer));
+	bytes_until_sample = next_sample_interval();
+
+	// Past three quarters full the probe chains get long. Skip the sample.
+	if (sample_count >= SAMPLE_TABLE_SIZE / 4 * 3)
+		return;
+
+	size_t i = SAMPLE_HASH(ptr);
+	while (sample_table[i].ptr != NULL)
+		i = (i + 1) & (SAMPLE_TABLE_SIZE - 1);
 
- 		void* before = (void*) GET(BACK_LINK(after));
+	struct sf_sample *sample = &sample_table[i];
+	sample->ptr = ptr;
+	sample->size = size;
 
- 		freelist_pointer = (int64*)HEADER_ADDRESS(rp);
+	// Leave out this function's own frame.
+	void* stack[SAMPLE_MAX_DEPTH + 1];
+	int depth = backtrace(stack, SAMPLE_MAX_DEPTH + 1) - 1;
+	sample->depth = depth > 0 ? depth : 0;
+	memcpy(sample->stack, stack + 1, sample->depth * sizeof(void*));
 
- 		if (after != next_header)
- 			PUT(FORWARD_LINK(freelist_pointer), (int64)after);
- 		if (before != next_header)
- 			PUT(BACK_LINK(freelist_pointer), (int64)before);
+	// FNV-1a over the return addresses
+	sample->stack_hash = 14695981039346656037ULL;
+	for (int k = 0; k < sample->depth; k++)
+		sample->stack_hash = (sample->stack_hash ^ (int64)(uintptr_t)sample->stack[k]) * 1099511628211ULL;
 
- 		PUT(FORWARD_LINK(before), (int64)freelist_pointer);
- 		PUT(BACK_LINK(after), (int64)freelist_pointer);
+	sample_count++;
+}
+
+/**
+ * Forget the sample of ptr, if it has one. Free when nothing is sampled.
+ */
+static void drop_sample(void *ptr)
+{
+	if (sample_count == 0)
+		return;
 
- 		#ifdef NEXT
- 			// if the next-fit pointer is pointing to an allocated region 
-	 		// (because there were no free regions before)
-	 		// then also reset it to be rp.
-	 		if (GET_ALLOC(next_free_pointer) == ALLOCATED)
-	 			next_free_pointer = (void*)HEADER_ADDRESS(rp);
-		#endif 	
+	size_t i = SAMPLE_HASH(ptr);
+	while (sample_table[i].ptr != NULL)
+	{
+		if (sample_table[i].ptr == ptr)
+		{
+			drop_sample_at(i);
+			return;
+		}
+		i = (i + 1) & (SAMPLE_TABLE_SIZE - 1);
 	}
+}
 
-	// CASE 2
-	else if (is_prev_alloc && !is_next_alloc)
+/**
+ * Empty entry i of the sample table. Later entries of the same probe chain
+ * move back into the hole, so lookups never need tombstones.
+ */
+static void drop_sample_at(size_t i)
+{
+	sample_table[i].ptr = NULL;
+	sample_count--;
+
+	size_t hole = i;
+	size_t j = (i + 1) & (SAMPLE_TABLE_SIZE - 1);
+	while (sample_table[j].ptr != NULL)
 	{
-		#ifdef DEBUG
-			printf("coalescing case 2\n");
-		#endif
-		/*
-		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
-		|    |    |    |    |    |    |	   |    |    |    |    |    |
-		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
-		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
-		 				allo free           free free
+		// An entry can fill the hole if its home slot is not in (hole, j].
+		size_t home = SAMPLE_HASH(sample_table[j].ptr);
+		if (((j - home) & (SAMPLE_TABLE_SIZE - 1)) >= ((j - hole) & (SAMPLE_TABLE_SIZE - 1)))
+		{
+			sample_table[hole] = sample_table[j];
+			sample_table[j].ptr = NULL;
+			hole = j;
+		}
+		j = (j + 1) & (SAMPLE_TABLE_SIZE - 1);
+	}
+}
 
- 		*/
-		size += GET_REGION_SIZE(NEXT_HEADER_ADDRESS(rp));
-		PUT(HEADER_ADDRESS(rp), PACK(0, size, FREE));
-		PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE));
+/**
+ * Forget every sample in a heap that is about to be destroyed.
+ */
+static void drop_samples_of_heap(struct sf_heap *h)
+{
+	struct sf_heap *saved = heap;
+	heap = h;
+
+	// Entries move back into the slots drop_sample_at empties, so look at
+	// the same slot again after a drop. Anything that wraps around to the
+	// front of the table was already looked at.
+	size_t i = 0;
+	while (i < SAMPLE_TABLE_SIZE && sample_count > 0)
+	{
+		char* ptr = sample_table[i].ptr;
+		if (ptr != NULL && ((ptr >= (char*)h && ptr < h->brk_limit) || is_large_ptr(ptr)))
+			drop_sample_at(i);
+		else
+			i++;
+	}
+
+	heap = saved;
+}
+
+/**
+ * Bytes until the next sample. Exponentially distributed with a mean of
+ * sample_rate, so sampling is a Poisson process over the bytes allocated and
+ * no allocation pattern can line up with it.
+ */
+static size_t next_sample_interval()
+{
+	// xorshift64*
+	sample_seed ^= sample_seed >> 12;
+	sample_seed ^= sample_seed << 25;
+	sample_seed ^= sample_seed >> 27;
+	int64 r = sample_seed * 2685821657736338717ULL;
+
+	// Uniform in (0, 1], then -ln(u) * mean
+	double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return (size_t)(-fast_log2(u) * 0.6931471805599453 * sample_rate) + 1;
+}
+
+/**
+ * log2 to within about 0.005, which is plenty for drawing sample intervals
+ * and saves linking libm.
+ */
+static double fast_log2(double x)
+{
+	int64 bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int exponent = (int)((bits >> 52) & 0x7FF) - 1023;
+
+	// x = m * 2^exponent with m in [1, 2). Fit a parabola to 1 + log2(m).
+	bits = (bits & 0xFFFFFFFFFFFFFULL) | (1023ULL << 52);
+	double m;
+	memcpy(&m, &bits, sizeof(m));
+
+	return exponent - 1 + (-0.34484843 * m + 2.02466578) * m - 0.67487759;
+}
 
- 		// LIFO
- 		// 
- 		void* after = (void*) GET(FORWARD_LINK(next_header));
- 		void* before = (void*) GET(BACK_LINK(next_header));
+/**
+ * Count an untagged allocated region against tag, and mark it.
+ */
+static void tag_region(void *ptr, size_t tag)
+{
+	char* hp = HEADER_ADDRESS(ptr);
+	PUT(hp, GET(hp) | TAGGED);
+
+	// The footer of an allocated region only needs its allocated bit, so the
+	// tag can take the requested size's place.
+	if (GET_LARGE(hp))
+		LARGE_SEGMENT(ptr)->tag = tag;
+	else
+		PUT(FOOTER_ADDRESS(ptr), PACK((int64)tag, GET(hp) & 0xFFFFFFFF, 0));
+
+	struct sf_tag_stats *stats = &heap->tags[tag];
+	stats->live_bytes += GET_REQUESTED_SIZE(hp);
+	stats->live_allocations++;
+	if (stats->live_bytes > stats->peak_bytes)
+		stats->peak_bytes = stats->live_bytes;
+}
 
- 		PUT(FORWARD_LINK(before), (int64)after);
- 		PUT(BACK_LINK(after), (int64)before);
+/**
+ * Stop counting an allocated region against its tag, if it has one.
+ */
+static void untag_region(void *ptr)
+{
+	char* hp = HEADER_ADDRESS(ptr);
+	if (!GET_TAGGED(hp))
+		return;
 
-		//
- 		after = freelist_pointer;
- 		if (after == (int64*)HEADER_ADDRESS(rp) || after == next_header)
- 			after = (void*)GET(FORWARD_LINK(freelist_pointer));
+	struct sf_tag_stats *stats = &heap->tags[get_tag(ptr)];
+	stats->live_bytes -= GET_REQUESTED_SIZE(hp);
+	stats->live_allocations--;
 
- 		before = (void*) GET(BACK_LINK(after));
+	PUT(hp, GET(hp) & ~(int64)TAGGED);
+	if (!GET_LARGE(hp))
+		PUT(FOOTER_ADDRESS(ptr), GET(hp));
+}
 
- 		freelist_pointer = (int64*)HEADER_ADDRESS(rp);
+/**
+ * @return The tag of an allocated region, or 0 if it has none.
+ */
+static size_t get_tag(void *ptr)
+{
+	char* hp = HEADER_ADDRESS(ptr);
+	if (!GET_TAGGED(hp))
+		return 0;
+	if (GET_LARGE(hp))
+		return LARGE_SEGMENT(ptr)->tag;
+	return GET_TAG(FOOTER_ADDRESS(ptr));
+}
 
- 		if (after != next_header)
- 			PUT(FORWARD_LINK(freelist_pointer), (int64)after);
- 		if (before != next_header)
- 			PUT(BACK_LINK(freelist_pointer), (int64)before);
+/**
+ * Record an event in this thread's trace ring if tracing is on. Only the
+ * default heap is traced, as that is the one a replay runs on.
+ */
+static void trace(int op, void *ptr, int64 arg, size_t size)
+{
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED) || heap != &default_heap)
+		return;
 
- 		PUT(FORWARD_LINK(before), (int64)freelist_pointer);
- 		PUT(BACK_LINK(after), (int64)freelist_pointer);
+	struct sf_trace_ring *ring = trace_ring();
+	if (ring == NULL)
+		return;
 
-	 	#ifdef NEXT
-	 		// if the next-fit pointer is coalesced into rp, we reset it to be rp.
-			if (next_free_pointer == next_header)	
-				next_free_pointer = (void*)HEADER_ADDRESS(rp);
-			// if the next-fit pointer is pointing to an allocated region 
-	 		// (because there were no free regions before)
-	 		// then also reset it to be rp.
-	 		if (GET_ALLOC(next_free_pointer) == ALLOCATED)
-	 			next_free_pointer = (void*)HEADER_ADDRESS(rp);
-		#endif 		
-	}
-	
-	// CASE 3
-	else if (!is_prev_alloc && is_next_alloc)
+	// Dropping is better than waiting for the flusher in the middle of a malloc.
+	size_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_EVENTS)
 	{
-		#ifdef DEBUG
-			printf("coalescing case 3\n");
-		#endif
-		/*
-		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
-		|    |    |    |    |    |    |	   |    |    |    |    |    |
-		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
-		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
-		 				free free           free allo
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
 
- 		*/
-		size += GET_REGION_SIZE(PREV_FOOTER_ADDRESS(rp));
-		PUT(FOOTER_ADDRESS(rp), PACK(0, size, FREE));
-		PUT(HEADER_ADDRESS(PREV_REGION(rp)), PACK(0, size, FREE));
-		rp = (int64*)PREV_REGION(rp);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
- 		// LIFO
- 		void* after = (void*) GET(FORWARD_LINK(prev_header));
- 		void* before = (void*) GET(BACK_LINK(prev_header));
+	struct sf_trace_event *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+	event->seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+	event->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	event->ptr = (int64)ptr;
+	event->arg = arg;
+	event->size = size;
+	event->thread = ring->thread;
+	event->op = op;
 
- 		PUT(FORWARD_LINK(before), (int64)after);
- 		PUT(BACK_LINK(after), (int64)before);
+	// The flusher may read the event once it sees the new head.
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
- 		//
+/**
+ * The calling thread's trace ring, mapped and linked in on first use.
+ * @return The ring, or NULL if it could not be mapped.
+ */
+static struct sf_trace_ring *trace_ring()
+{
+	if (thread_ring != NULL)
+		return thread_ring;
 
- 		after = freelist_pointer;
- 		if (after == (int64*)HEADER_ADDRESS(rp) || after == next_header)
- 			after = (void*)GET(FORWARD_LINK(freelist_pointer));
+	struct sf_trace_ring *ring = mmap(NULL, sizeof(struct sf_trace_ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
 
- 		before = (void*) GET(BACK_LINK(after));
+	ring->thread = syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
 
- 		freelist_pointer = (int64*)HEADER_ADDRESS(rp);
+	thread_ring = ring;
+	return ring;
+}
 
- 		if (after != next_header)
- 			PUT(FORWARD_LINK(freelist_pointer), (int64)after);
- 		if (before != next_header)
- 			PUT(BACK_LINK(freelist_pointer), (int64)before);
+/**
+ * Write out every event the rings hold. Only one thread may flush at a time.
+ */
+static void flush_trace()
+{
+	struct sf_trace_ring *ring;
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+	{
+		size_t tail = ring->tail;
+		size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
 
- 		PUT(FORWARD_LINK(before), (int64)freelist_pointer);
- 		PUT(BACK_LINK(after), (int64)freelist_pointer);
+		// At most two writes, for the part before and after the wrap.
+		while (tail != head)
+		{
+			size_t start = tail & (TRACE_RING_EVENTS - 1);
+			size_t count = head - tail;
+			if (start + count > TRACE_RING_EVENTS)
+				count = TRACE_RING_EVENTS - start;
+
+			if (!trace_failed && write_all(trace_fd, &ring->events[start], count * sizeof(struct sf_trace_event)) != 0)
+				trace_failed = true;
+			tail += count;
+		}
 
- 		#ifdef NEXT
- 			// if the next-fit pointer is pointing to an allocated region 
-	 		// (because there were no free regions before)
-	 		// then also reset it to be rp.
-	 		if (GET_ALLOC(next_free_pointer) == ALLOCATED)
-	 			next_free_pointer = (void*)HEADER_ADDRESS(rp);
-		#endif 		
+		// Hand the slots back to the thread.
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 	}
+}
 
-	// CASE 4
-	else
+static void *trace_flusher_main(void *arg)
+{
+	struct timespec interval = { 0, TRACE_FLUSH_INTERVAL_US * 1000 };
+	while (__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
 	{
-		#ifdef DEBUG
-			printf("coalescing case 4\n");
-		#endif
-		/*
-		 ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____ ____
-		|    |    |    |    |    |    |	   |    |    |    |    |    |
-		|    |    |    | F  | H  | rp |    | F  | H  |    |    |    |
-		 ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ----
-		 				free free           free free
-
- 		*/
-		size += GET_REGION_SIZE(PREV_FOOTER_ADDRESS(rp)) + GET_REGION_SIZE(NEXT_HEADER_ADDRESS(rp));
-		PUT(HEADER_ADDRESS(PREV_REGION(rp)), PACK(0, size, FREE));
-		PUT(FOOTER_ADDRESS(NEXT_REGION(rp)), PACK(0, size, FREE));
-		rp = (int64*)PREV_REGION(rp);
-
- 		// LIFO
- 		// 
- 		void* after = (void*) GET(FORWARD_LINK(next_header));
- 		void* before = (void*) GET(BACK_LINK(next_header));
-
- 		PUT(FORWARD_LINK(before), (int64)after);
- 		PUT(BACK_LINK(after), (int64)before);
-
- 		//
- 		//
- 		after = (void*) GET(FORWARD_LINK(prev_header));
- 		before = (void*) GET(BACK_LINK(prev_header));
-
- 		PUT(FORWARD_LINK(before), (int64)after);
- 		PUT(BACK_LINK(after), (int64)before);
- 		//
- 		
- 		after = freelist_pointer;
- 		if (after == (int64*)HEADER_ADDRESS(rp) || after == next_header)
- 			after = (void*)GET(FORWARD_LINK(freelist_pointer));
-
- 		before = (void*) GET(BACK_LINK(after));
-
- 		freelist_pointer = (int64*)HEADER_ADDRESS(rp);
-
- 		if (after != next_header)
- 			PUT(FORWARD_LINK(freelist_pointer), (int64)after);
- 		if (before != next_header)
- 			PUT(BACK_LINK(freelist_pointer), (int64)before);
-
- 		PUT(FORWARD_LINK(before), (int64)freelist_pointer);
- 		PUT(BACK_LINK(after), (int64)freelist_pointer);
-
-	 	#ifdef NEXT
-	 		// if the next-fit pointer is coalesced into rp, we reset it to be rp.
-			if (next_free_pointer == next_header)
-				next_free_pointer = (void*)HEADER_ADDRESS(rp);
- 			// if the next-fit pointer is pointing to an allocated region 
-	 		// (because there were no free regions before)
-	 		// then also reset it to be rp.
-	 		if (GET_ALLOC(next_free_pointer) == ALLOCATED)
-	 			next_free_pointer = (void*)HEADER_ADDRESS(rp);	
-		#endif		
-	}
-
-	// easy fix hack
-	#ifdef ADDRESS
-		convert_to_address_policy();
-	#endif
-
-	return rp;
+		flush_trace();
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
 }
 
 void print_all_regions()
@@ -808,9 +3198,9 @@ void print_all_regions()
 	printf("\nPRINTING ALL REGION\n");
 	printf("--------------------");
 
-	int64* ptr = prologue_footer;
+	int64* ptr = heap->prologue_footer;
 	ptr = (int64*)NEXT_WORD(ptr);
-	while(ptr != epilogue_header)
+	while(ptr != heap->epilogue_header)
 	{
 		print_region_stats(NEXT_WORD(ptr));
 		ptr = (int64*)NEXT_HEADER_ADDRESS(NEXT_WORD(ptr));
@@ -872,7 +3262,7 @@ static bool is_valid_heap_ptr(void* ptr_to_free)
 	// 	- if ptr = NULL, return out
 	// 	- if ptr = middle of region, return out
 	// 	- if ptr = area not in heap, return out
-	if (ptr_to_free == NULL || ptr_to_free <= (void*)prologue_footer || ptr_to_free >= (void*)epilogue_header)
+	if (ptr_to_free == NULL || ptr_to_free <= (void*)heap->prologue_footer || ptr_to_free >= (void*)heap->epilogue_header)
 	{
 		#ifdef DEBUG
 			printf("invalid pointer! cannot free! - %p\n", ptr_to_free);
@@ -880,9 +3270,9 @@ static bool is_valid_heap_ptr(void* ptr_to_free)
 		return false;
 	}
 
-	int64* ptr = prologue_footer;
+	int64* ptr = heap->prologue_footer;
 	ptr = (int64*)NEXT_WORD(ptr);
-	while(ptr != epilogue_header)
+	while(ptr != heap->epilogue_header)
 	{
 		if ((void*)NEXT_WORD(ptr) == ptr_to_free)
 		{
@@ -900,7 +3290,411 @@ static bool is_valid_heap_ptr(void* ptr_to_free)
 	return false;
 }
 
-#ifdef ADDRESS
+/**
+ * Check whether the allocator may grow by inc more bytes.
+ * Crossing the soft limit fires the pressure callbacks. Before refusing growth
+ * past the hard limit, the callbacks get another chance to free memory and the
+ * heap is trimmed as far as it goes.
+ * @return true if the growth stays within the limits.
+ */
+static bool within_limits(size_t inc)
+{
+	size_t used = footprint();
+
+	if (soft_limit != 0 && used <= soft_limit && used + inc > soft_limit)
+		fire_pressure_callbacks(used + inc);
+
+	if (hard_limit == 0 || footprint() + inc <= hard_limit)
+		return true;
+
+	#ifdef DEBUG
+		printf("hard limit of %lu reached. Relieving pressure.\n", hard_limit);
+	#endif
+
+	fire_pressure_callbacks(footprint() + inc);
+	relieve_pressure();
+
+	// The callbacks free to the default heap.
+	if (heap != &default_heap)
+	{
+		struct sf_heap *saved = heap;
+		heap = &default_heap;
+		relieve_pressure();
+		heap = saved;
+	}
+
+	return footprint() + inc <= hard_limit;
+}
+
+/**
+ * Give the free space at the top of the current heap back, including what
+ * the pressure callbacks just freed into the fast bins or the pending list.
+ */
+static void relieve_pressure()
+{
+	coalesce_deferred_frees();
+	trim_heap(true);
+}
+
+/**
+ * Bytes used by every heap and its large objects together.
+ */
+static size_t footprint()
+{
+	size_t used = 0;
+	struct sf_heap *h;
+	for (h = &default_heap; h != NULL; h = h->next)
+		used += h->heap_size + h->large_bytes;
+	return used;
+}
+
+static void fire_pressure_callbacks(size_t footprint)
+{
+	if (in_pressure_callback)
+		return;
+
+	// Callbacks free through sf_free, which works on the default heap.
+	struct sf_heap *saved = heap;
+	heap = &default_heap;
+
+	in_pressure_callback = true;
+	int i;
+	for (i = 0; i < num_pressure_callbacks; i++)
+		pressure_callbacks[i].callback(footprint, pressure_callbacks[i].arg);
+	in_pressure_callback = false;
+
+	heap = saved;
+}
+
+struct prefault_job
+{
+	char *start;
+	char *end;
+};
+
+/**
+ * Fault in every page in [start, end) without changing its contents.
+ * With parallel, the range is split between one thread per online CPU.
+ */
+static void prefault(char *start, char *end, bool parallel)
+{
+	struct prefault_job jobs[MAX_PREFAULT_THREADS];
+	pthread_t threads[MAX_PREFAULT_THREADS];
+
+	long nthreads = parallel ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_PREFAULT_THREADS)
+		nthreads = MAX_PREFAULT_THREADS;
+
+	size_t slice = ALIGN_UP((end - start + nthreads - 1) / nthreads, FOUR_KB);
+
+	long i;
+	for (i = 0; i < nthreads; i++)
+	{
+		jobs[i].start = start + i * slice < end ? start + i * slice : end;
+		jobs[i].end = jobs[i].start + slice < end ? jobs[i].start + slice : end;
+
+		// The first slice is ours. Do it on this thread if we cannot start another one.
+		if (i == 0 || pthread_create(&threads[i], NULL, prefault_worker, &jobs[i]) != 0)
+		{
+			prefault_worker(&jobs[i]);
+			jobs[i].start = NULL;
+		}
+	}
+
+	for (i = 1; i < nthreads; i++)
+	{
+		if (jobs[i].start != NULL)
+			pthread_join(threads[i], NULL);
+	}
+}
+
+static void *prefault_worker(void *arg)
+{
+	struct prefault_job *job = (struct prefault_job *)arg;
+	if (job->start >= job->end)
+		return NULL;
+
+	#ifdef MADV_POPULATE_WRITE
+		// One syscall instead of a fault per page, when the kernel has it.
+		if (madvise(job->start, job->end - job->start, MADV_POPULATE_WRITE) == 0)
+			return NULL;
+	#endif
+
+	char* page;
+	for (page = job->start; page < job->end; page += FOUR_KB)
+	{
+		volatile char* byte = page;
+		*byte = *byte;
+	}
+	return NULL;
+}
+
+/**
+ * Map a new segment for a large object. Large objects never touch the heap or
+ * the free list, so freeing one gives its memory straight back to the system.
+ * @param alignment DSIZE, or a bigger power of two for sf_aligned_alloc.
+ * Mappings are page aligned, so up to a page only the payload offset changes.
+ * Bigger alignments map extra and give back the unused tail.
+ * @return pointer to the payload, or NULL if the mapping failed.
+ */
+static void *allocate_large(size_t size, size_t alignment)
+{
+	size_t offset = LARGE_PAYLOAD_OFFSET(alignment);
+	size_t map_size = ALIGN_UP(offset + size, FOUR_KB);
+	if (alignment > FOUR_KB)
+		map_size = ALIGN_UP(alignment + size, FOUR_KB);
+
+	if (!within_limits(map_size))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct large_segment *seg = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (seg == MAP_FAILED)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	#ifdef DEBUG
+		printf("mapped large object of %lu bytes at %p\n", map_size, seg);
+	#endif
+
+	if (alignment > FOUR_KB)
+	{
+		offset = ALIGN_UP((char*)seg + LARGE_PAYLOAD_OFFSET(DSIZE), alignment) - (uintptr_t)seg;
+		size_t used = ALIGN_UP(offset + size, FOUR_KB);
+		if (used < map_size)
+			munmap((char*)seg + used, map_size - used);
+		map_size = used;
+	}
+
+	seg->map_size = map_size;
+
+	char* rp = (char*)seg + offset;
+	PUT(HEADER_ADDRESS(rp), PACK((int64)size, offset, LARGE | ALLOCATED));
+
+	seg->payload = rp;
+	if (!add_large(rp))
+	{
+		munmap(seg, map_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	seg->heap = heap;
+	seg->prev = NULL;
+	seg->next = heap->large_list;
+	if (heap->large_list != NULL)
+		heap->large_list->prev = seg;
+	heap->large_list = seg;
+
+	heap->large_bytes += map_size;
+
+	return rp;
+}
+
+/**
+ * Unmap a large object. ptr must already be validated with is_large_ptr.
+ */
+static void free_large(void *ptr)
+{
+	drop_sample(ptr);
+	untag_region(ptr);
+
+	struct large_segment *seg = LARGE_SEGMENT(ptr);
+	remove_large(seg->payload);
+
+	if (seg->prev != NULL)
+		seg->prev->next = seg->next;
+	else
+		heap->large_list = seg->next;
+	if (seg->next != NULL)
+		seg->next->prev = seg->prev;
+
+	heap->large_bytes -= seg->map_size;
+
+	#ifdef DEBUG
+		printf("unmapping large object of %lu bytes at %p\n", seg->map_size, seg);
+	#endif
+
+	munmap(seg, seg->map_size);
+}
+
+/**
+ * Resize a large object by moving or extending its mapping with mremap.
+ * The kernel moves the page table entries, so no payload bytes are copied
+ * no matter how big the object is.
+ * @return pointer to the payload, or NULL with the old object untouched.
+ */
+static void *realloc_large(void *ptr, size_t size)
+{
+	struct large_segment *seg = LARGE_SEGMENT(ptr);
+	size_t offset = GET_REGION_SIZE(HEADER_ADDRESS(ptr));
+	size_t map_size = ALIGN_UP(offset + size, FOUR_KB);
+
+	if (map_size > seg->map_size && !within_limits(map_size - seg->map_size))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (map_size != seg->map_size)
+	{
+		struct large_segment *new_seg = mremap(seg, seg->map_size, map_size, MREMAP_MAYMOVE);
+		if (new_seg == MAP_FAILED)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		#ifdef DEBUG
+			printf("remapped large object %p (%lu bytes) to %p (%lu bytes)\n", seg, seg->map_size, new_seg, map_size);
+		#endif
+
+		heap->large_bytes += map_size - new_seg->map_size;
+		new_seg->map_size = map_size;
+		if (new_seg != seg)
+		{
+			// Removing never grows the table, so the add has room.
+			remove_large(new_seg->payload);
+			new_seg->payload = (char*)new_seg + offset;
+			add_large(new_seg->payload);
+		}
+		seg = new_seg;
+
+		// The mapping may have moved, so fix up the links that point at it.
+		if (seg->prev != NULL)
+			seg->prev->next = seg;
+		else
+			heap->large_list = seg;
+		if (seg->next != NULL)
+			seg->next->prev = seg;
+	}
+
+	char* rp = (char*)seg + offset;
+	PUT(HEADER_ADDRESS(rp), PACK((int64)size, offset, LARGE | ALLOCATED));
+
+	return rp;
+}
+
+/**
+ * O(1) check for large objects of the current heap. The payload of a large
+ * object sits at LARGE_PAYLOAD_OFFSET into its mapping: 64 bytes or a power of
+ * two alignment. Any other offset into a page is rejected without reading
+ * memory, and nothing is read until the large object table knows ptr, since a
+ * pointer from someone else's mmap may have nothing mapped in front of it.
+ */
+static bool is_large_ptr(void *ptr)
+{
+	uintptr_t page_offset = (uintptr_t)ptr & (FOUR_KB - 1);
+	bool aligned_offset = (page_offset & (page_offset - 1)) == 0 && (page_offset == 0 || page_offset >= LARGE_PAYLOAD_OFFSET(DSIZE));
+	if (ptr == NULL || (page_offset != LARGE_PAYLOAD_OFFSET(DSIZE) && !aligned_offset))
+		return false;
+
+	if ((int64*)ptr > heap->heap_start && (int64*)ptr < heap->epilogue_header)
+		return false;
+
+	if (large_count == 0)
+		return false;
+
+	size_t mask = ((size_t)1 << large_table_bits) - 1;
+	size_t i = POINTER_HASH(ptr, large_table_bits);
+	while (large_table[i] != ptr)
+	{
+		if (large_table[i] == NULL)
+			return false;
+		i = (i + 1) & mask;
+	}
+
+	// Ours, but maybe another heap's.
+	return LARGE_SEGMENT(ptr)->heap == heap;
+}
+
+/**
+ * Enter the payload of a new large object in the large object table, growing
+ * the table first if it would be more than half full.
+ * @return false if the table could not grow.
+ */
+static bool add_large(char *payload)
+{
+	if ((large_count + 1) * 2 > ((size_t)1 << large_table_bits) && !grow_large_table())
+		return false;
+
+	size_t mask = ((size_t)1 << large_table_bits) - 1;
+	size_t i = POINTER_HASH(payload, large_table_bits);
+	while (large_table[i] != NULL)
+		i = (i + 1) & mask;
+	large_table[i] = payload;
+	large_count++;
+	return true;
+}
+
+/**
+ * Take a payload out of the large object table. Later entries of the same
+ * probe chain move back into the hole, like in drop_sample_at.
+ */
+static void remove_large(char *payload)
+{
+	size_t mask = ((size_t)1 << large_table_bits) - 1;
+	size_t i = POINTER_HASH(payload, large_table_bits);
+	while (large_table[i] != payload)
+	{
+		if (large_table[i] == NULL)
+			return;
+		i = (i + 1) & mask;
+	}
+
+	large_table[i] = NULL;
+	large_count--;
+
+	size_t hole = i;
+	size_t j = (i + 1) & mask;
+	while (large_table[j] != NULL)
+	{
+		size_t home = POINTER_HASH(large_table[j], large_table_bits);
+		if (((j - home) & mask) >= ((j - hole) & mask))
+		{
+			large_table[hole] = large_table[j];
+			large_table[j] = NULL;
+			hole = j;
+		}
+		j = (j + 1) & mask;
+	}
+}
+
+/**
+ * Map a large object table twice the size, or LARGE_TABLE_BITS for the
+ * first, and move every entry over.
+ */
+static bool grow_large_table()
+{
+	size_t bits = large_table == NULL ? LARGE_TABLE_BITS : large_table_bits + 1;
+	size_t size = (size_t)1 << bits;
+	char **table = mmap(NULL, size * sizeof(char*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED)
+		return false;
+
+	size_t i;
+	for (i = 0; large_table != NULL && i < ((size_t)1 << large_table_bits); i++)
+	{
+		if (large_table[i] == NULL)
+			continue;
+		size_t j = POINTER_HASH(large_table[i], bits);
+		while (table[j] != NULL)
+			j = (j + 1) & (size - 1);
+		table[j] = large_table[i];
+	}
+
+	if (large_table != NULL)
+		munmap(large_table, ((size_t)1 << large_table_bits) * sizeof(char*));
+	large_table = table;
+	large_table_bits = bits;
+	return true;
+}
 
 /**
  * Converts the freelist into an address policy list.
@@ -909,31 +3703,32 @@ static bool is_valid_heap_ptr(void* ptr_to_free)
 static void convert_to_address_policy()
 {
 	// Start
-	void *iter_head = NEXT_WORD(prologue_footer);
+	void *iter_head = NEXT_WORD(heap->prologue_footer);
 
 	// 1. find the first free region and set it to freelist_pointer
 	// iterate through every region until we find a free region
-	while (iter_head != epilogue_header && GET_ALLOC(iter_head) != FREE)
+	while (iter_head != heap->epilogue_header && GET_ALLOC(iter_head) != FREE)
 	{
 		iter_head = NEXT_HEADER_ADDRESS(NEXT_WORD(iter_head));
 	}
 
-	// found the first free region
-	freelist_pointer = iter_head;
-
-	if (iter_head == epilogue_header)
+	if (iter_head == heap->epilogue_header)
 	{
 		#ifdef DEBUG
 			printf("No free regions when converting to address policy.\n");
 		#endif
+		heap->freelist_pointer = NULL;
 		return;
 	}
+
+	// found the first free region
+	heap->freelist_pointer = iter_head;
 	
 	// 2. continuously iterate through every region.
 	// if free, link to prev region
 	void *prev_head = iter_head; // keep track of previous region so we can link them.
 	iter_head = NEXT_HEADER_ADDRESS(NEXT_WORD(iter_head)); // next region
-	while (iter_head != epilogue_header)
+	while (iter_head != heap->epilogue_header)
 	{
 		if (GET_ALLOC(iter_head) == FREE)
 		{
@@ -946,9 +3741,68 @@ static void convert_to_address_policy()
 	}
 	
 	// 3. once we reach the end, link the last prev_head with freelist_pointer
-	PUT(FORWARD_LINK(prev_head), (int64)freelist_pointer);
-	PUT(BACK_LINK(freelist_pointer), (int64)prev_head);
+	PUT(FORWARD_LINK(prev_head), (int64)heap->freelist_pointer);
+	PUT(BACK_LINK(heap->freelist_pointer), (int64)prev_head);
+
+}
+
+/**
+ * Switch the current heap to policy. Every free list is a valid LIFO list, so
+ * only a switch to address order has to rebuild it.
+ */
+static void set_policy(int policy)
+{
+	if (policy == heap->policy)
+		return;
+
+	#ifdef DEBUG
+		printf("switching policy from %d to %d\n", heap->policy, policy);
+	#endif
+
+	if ((policy & SF_POLICY_ADDRESS) && !(heap->policy & SF_POLICY_ADDRESS))
+		convert_to_address_policy();
 
+	heap->policy = policy;
+	heap->policy_switches++;
 }
 
-#endif
\ No newline at end of file
+/**
+ * SF_POLICY_AUTO: see how the current heap did since the last look, and trade
+ * search time for fragmentation or back. LIFO is fastest until fragmentation
+ * climbs, then the list goes into address order. First fit on it packs
+ * tightest but searches longest, so while searches are long and fragmentation
+ * is not, it takes next fit. LIFO comes back once fragmentation is low.
+ */
+static void tune_policy()
+{
+	double probes = (double)(heap->find_fit_probes - heap->tuned_probes) / (heap->find_fit_calls - heap->tuned_calls);
+	heap->tuned_calls = heap->find_fit_calls;
+	heap->tuned_probes = heap->find_fit_probes;
+
+	// sf_stats would walk the whole free list for the largest free region.
+	// The top region and the largest region the searches found since the last
+	// look stand in for it, which can only overstate fragmentation.
+	size_t largest = heap->tuned_largest;
+	heap->tuned_largest = 0;
+	char* top_footer = PREV_WORD(heap->epilogue_header);
+	if (GET_ALLOC(top_footer) == FREE && GET_REGION_SIZE(top_footer) > largest)
+		largest = GET_REGION_SIZE(top_footer);
+
+	size_t free_bytes = free_list_bytes();
+	double fragmentation = free_bytes == 0 || largest >= free_bytes ? 0.0 : 1.0 - (double)largest / free_bytes;
+
+	int policy = heap->policy & ~SF_POLICY_AUTO;
+	if (!(policy & SF_POLICY_ADDRESS))
+	{
+		if (fragmentation > AUTO_FRAGMENTATION_HIGH)
+			policy = SF_POLICY_ADDRESS;
+	}
+	else if (fragmentation < AUTO_FRAGMENTATION_LOW)
+		policy = 0;
+	else if (fragmentation > AUTO_FRAGMENTATION_HIGH)
+		policy = SF_POLICY_ADDRESS;
+	else if (probes > AUTO_PROBES_HIGH)
+		policy = SF_POLICY_ADDRESS | SF_POLICY_NEXT;
+
+	set_policy(policy | SF_POLICY_AUTO);
+}
\ No newline at end of file
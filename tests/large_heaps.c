@@ -0,0 +1,46 @@
+#include "../sfmm.c"
+
+/**
+ * Large objects belong to the heap that mapped them. Destroying another heap
+ * must leave their samples alone, and freeing them on another heap must
+ * leave them and both heaps' counters alone:
+ *
+ * make check
+ */
+
+/* Large objects on the heap that stays */
+#define KEPT_OBJECTS 3
+
+int main()
+{
+	sf_mem_init();
+	sf_mallopt(SF_SAMPLE_RATE, 1);
+
+	struct sf_heap *destroyed = sf_heap_create(0);
+	struct sf_heap *kept = sf_heap_create(0);
+	if (destroyed == NULL || kept == NULL || sf_heap_malloc(destroyed, 1024 * 1024) == NULL)
+		return EXIT_FAILURE;
+
+	void *kept_objects[KEPT_OBJECTS];
+	int i;
+	for (i = 0; i < KEPT_OBJECTS; i++)
+		if ((kept_objects[i] = sf_heap_malloc(kept, 1024 * 1024)) == NULL)
+			return EXIT_FAILURE;
+
+	// Only the head of a heap's large object list used to be told apart.
+	sf_heap_destroy(destroyed);
+	bool samples_kept = sample_count == KEPT_OBJECTS;
+	printf("large heaps: %-18s %s\n", "destroy samples", samples_kept ? "ok" : "FAILED");
+
+	struct sf_heap *other = sf_heap_create(0);
+	if (other == NULL)
+		return EXIT_FAILURE;
+	size_t large_bytes = kept->large_bytes;
+	sf_heap_free(other, kept_objects[1]);
+	bool free_refused = other->large_bytes == 0 && kept->large_bytes == large_bytes && sample_count == KEPT_OBJECTS;
+	printf("large heaps: %-18s %s\n", "free on other heap", free_refused ? "ok" : "FAILED");
+
+	sf_heap_destroy(other);
+	sf_heap_destroy(kept);
+	return samples_kept && free_refused ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,109 @@
+#include "../sfmm.c"
+
+#include <sys/wait.h>
+
+/**
+ * A request that only fits once a pressure callback drops a cache has to
+ * succeed, even when the callback's frees are not coalesced right away.
+ * Build it with and without -DDEFERRED:
+ *
+ * make check
+ */
+
+/* Fewer than the pending list or a fast bin holds, so nothing coalesces them on the way */
+#define CACHE_OBJECTS 63
+
+struct pressure_case
+{
+	const char *name;
+	size_t object_size;	// of each object in the cache
+	size_t fast_bins;	// SF_FAST_BINS
+};
+
+static void *cache[CACHE_OBJECTS];
+static int callbacks = 0;
+
+static void drop_cache(size_t footprint, void *arg)
+{
+	(void)footprint;
+	(void)arg;
+
+	int i;
+	for (i = 0; i < CACHE_OBJECTS; i++)
+	{
+		sf_free(cache[i]);
+		cache[i] = NULL;
+	}
+	callbacks++;
+}
+
+/**
+ * Allocate what is left of the free region at the top of the heap, so the
+ * next request has to grow it. With -DHUGEPAGE that is most of 2 MB.
+ */
+static bool fill_top()
+{
+	char* top_footer = PREV_WORD(heap->epilogue_header);
+	while (GET_ALLOC(top_footer) == FREE)
+	{
+		size_t top_size = GET_REGION_SIZE(top_footer);
+		size_t size = top_size - 2 * WSIZE;
+		if (size >= large_threshold)
+			size = large_threshold / 2;
+		if (sf_malloc(size) == NULL)
+			return false;
+		top_footer = PREV_WORD(heap->epilogue_header);
+	}
+	return true;
+}
+
+/**
+ * Fill the cache, cap the footprint where it is, and ask for half of what the
+ * cache holds. Only the callback can make room for it.
+ * @return Whether the request succeeded after exactly one callback.
+ */
+static bool run(const struct pressure_case *c)
+{
+	sf_mem_init();
+	sf_mallopt(SF_FAST_BINS, c->fast_bins);
+
+	int i;
+	for (i = 0; i < CACHE_OBJECTS; i++)
+		if ((cache[i] = sf_malloc(c->object_size)) == NULL)
+			return false;
+	if (!fill_top())
+		return false;
+
+	sf_register_pressure_callback(drop_cache, NULL);
+	sf_set_limit(0, footprint());
+
+	void *ptr = sf_malloc(CACHE_OBJECTS * c->object_size / 2);
+	return ptr != NULL && callbacks == 1;
+}
+
+int main()
+{
+	struct pressure_case cases[] = {
+		{ "free", 1000, 0 },	// to the pending list with -DDEFERRED
+		{ "fast bins", 256, 256 },
+	};
+
+	int failed = 0;
+	size_t i;
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		// Each case starts from an empty heap in its own process.
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+			exit(run(&cases[i]) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+		int status;
+		waitpid(pid, &status, 0);
+		bool passed = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+		printf("pressure: %-10s %s\n", cases[i].name, passed ? "ok" : "FAILED");
+		failed += !passed;
+	}
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,95 @@
+#include "../sfmm.c"
+
+/**
+ * Traces a long random run of the allocator for ./replay, and prints what
+ * replay should report for it:
+ *
+ * ./tests/replay_trace <trace> > expected
+ * ./replay <trace> | grep -F "$(cat expected)"
+ *
+ * A few hundred live objects at a time keep reusing the same addresses, the
+ * case that makes a weak pointer hash pile up in the replay's address table.
+ * Build it with the same policy as replay, which must lay the heap out the
+ * same way to end up with the same counters.
+ */
+
+/* Allocation calls to trace. Each one that succeeds is freed again or reallocated later */
+#define TRACE_CALLS 150000
+#define LIVE_OBJECTS 512
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	// Starting the flusher thread makes the C library's malloc move the
+	// break. Past the heap, that would fence off memory the replay never sees.
+	if (sf_trace_start(fd) != 0)
+	{
+		perror("sf_trace_start");
+		return EXIT_FAILURE;
+	}
+	sf_mem_init();
+
+	static void *live[LIVE_OBJECTS];
+	srand(1);
+	size_t i;
+	for (i = 0; i < TRACE_CALLS; i++)
+	{
+		int k = rand() % LIVE_OBJECTS;
+		size_t size = rand() % 8 == 0 ? rand() % 16384 + 1 : rand() % 512 + 1;
+		switch (rand() % 4)
+		{
+			case 0:
+				live[k] = live[k] == NULL ? sf_malloc(size) : sf_realloc(live[k], size);
+				break;
+			case 1:
+				if (live[k] == NULL)
+					live[k] = sf_calloc(1, size);
+				break;
+			default:
+				if (live[k] == NULL)
+					live[k] = sf_malloc(size);
+				else
+				{
+					sf_free(live[k]);
+					live[k] = NULL;
+				}
+				break;
+		}
+
+		// Let the flusher keep up, so the ring never drops events.
+		if (i % 8192 == 0)
+			usleep(5 * TRACE_FLUSH_INTERVAL_US);
+	}
+
+	long dropped = sf_trace_stop();
+	if (dropped != 0)
+	{
+		fprintf(stderr, "%ld events dropped\n", dropped);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	struct sf_stats stats;
+	sf_stats(&stats);
+	#ifdef HUGEPAGE
+		// The top of the heap is kept 2 MB aligned, so how far it grows, and
+		// which fits are in touched pages, depends on where the break started.
+		printf("replay: requested=%lu allocated=\n", stats.requested_bytes);
+	#else
+		printf("replay: requested=%lu allocated=%lu free=%lu in %lu regions\n",
+			stats.requested_bytes, stats.allocated_bytes, stats.free_bytes, stats.free_regions);
+	#endif
+	return EXIT_SUCCESS;
+}